@@ -0,0 +1,191 @@
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+typedef unsigned long long word_t;
+
+#define WORD_BITS 64
+#define ALL_ONES (~(word_t) 0)
+
+struct bitmap {
+    long bits;
+    long nwords;
+    word_t *words;
+};
+
+
+Bitmap makeBM(long bits) {
+    Bitmap bm = (Bitmap) malloc(sizeof(struct bitmap));
+
+    bm->bits = bits > 0 ? bits : 0;
+    bm->nwords = (bm->bits + WORD_BITS - 1) / WORD_BITS;
+    bm->words = (word_t*) calloc(bm->nwords ? bm->nwords : 1, sizeof(word_t));
+
+    return bm;
+}
+
+void flushBM(Bitmap bm) {
+    if (bm) {
+        free(bm->words);
+        bm->words = NULL;
+        free(bm);
+    }
+}
+
+long sizeOfBM(Bitmap bm) {
+    return bm ? bm->bits : 0;
+}
+
+int testBM(Bitmap bm, long i) {
+    if (!bm || i < 0 || i >= bm->bits)
+        return 0;
+
+    return (bm->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+/* Mask of the bits [lo, hi) within a single word, 0 <= lo < hi <= 64 */
+static word_t maskBM(int lo, int hi) {
+    word_t upper = hi == WORD_BITS ? ALL_ONES : (((word_t) 1 << hi) - 1);
+    return upper & (ALL_ONES << lo);
+}
+
+static void fillRangeBM(Bitmap bm, long lo, long hi, int set) {
+    long wlo, whi;
+
+    if (!bm)
+        return;
+    if (lo < 0)
+        lo = 0;
+    if (hi > bm->bits)
+        hi = bm->bits;
+    if (lo >= hi)
+        return;
+
+    wlo = lo / WORD_BITS;
+    whi = (hi - 1) / WORD_BITS;
+
+    if (wlo == whi) {
+        /* Range sits inside one word */
+        word_t mask = maskBM(lo % WORD_BITS, (hi - 1) % WORD_BITS + 1);
+
+        if (set)
+            bm->words[wlo] |= mask;
+        else
+            bm->words[wlo] &= ~mask;
+        return;
+    }
+
+    /* Ragged ends, then whole words in between */
+    if (set) {
+        bm->words[wlo] |= maskBM(lo % WORD_BITS, WORD_BITS);
+        bm->words[whi] |= maskBM(0, (hi - 1) % WORD_BITS + 1);
+    } else {
+        bm->words[wlo] &= ~maskBM(lo % WORD_BITS, WORD_BITS);
+        bm->words[whi] &= ~maskBM(0, (hi - 1) % WORD_BITS + 1);
+    }
+
+    if (whi - wlo > 1)
+        memset(&bm->words[wlo + 1], set ? 0xFF : 0, (whi - wlo - 1) * sizeof(word_t));
+}
+
+void setRangeBM(Bitmap bm, long lo, long hi) {
+    fillRangeBM(bm, lo, hi, 1);
+}
+
+void clearRangeBM(Bitmap bm, long lo, long hi) {
+    fillRangeBM(bm, lo, hi, 0);
+}
+
+/**
+ * Scans for the first bit at or after from whose value differs from
+ * skip (a word of all zeroes when looking for set bits, or all ones
+ * when looking for clear bits).
+ */
+static long scanBM(Bitmap bm, long from, word_t skip) {
+    long w;
+    word_t word;
+
+    if (!bm || from >= bm->bits)
+        return bm ? bm->bits : 0;
+    if (from < 0)
+        from = 0;
+
+    /* The first word is masked so that bits before from are ignored */
+    w = from / WORD_BITS;
+    word = (bm->words[w] ^ skip) & (ALL_ONES << (from % WORD_BITS));
+
+    while (!word) {
+        w++;
+
+#ifdef __AVX2__
+        {
+            /* Skip 256 uninteresting bits at a time */
+            __m256i pattern = _mm256_set1_epi64x((long long) skip);
+
+            while (w + 4 <= bm->nwords) {
+                __m256i chunk = _mm256_loadu_si256((__m256i*) &bm->words[w]);
+                __m256i diff = _mm256_xor_si256(chunk, pattern);
+
+                if (!_mm256_testz_si256(diff, diff))
+                    break;
+                w += 4;
+            }
+        }
+#endif
+
+        if (w >= bm->nwords)
+            return bm->bits;
+
+        word = bm->words[w] ^ skip;
+    }
+
+    w = w * WORD_BITS + __builtin_ctzll(word);
+
+    /* Clear bits past the end of the map do not count */
+    return w < bm->bits ? w : bm->bits;
+}
+
+long nextSetBM(Bitmap bm, long from) {
+    return scanBM(bm, from, 0);
+}
+
+long nextClearBM(Bitmap bm, long from) {
+    return scanBM(bm, from, ALL_ONES);
+}
+
+long countSetBM(Bitmap bm) {
+    long count = 0;
+    long w;
+
+    if (!bm)
+        return 0;
+
+    for (w = 0; w < bm->nwords; w++)
+        count += __builtin_popcountll(bm->words[w]);
+
+    return count;
+}
+
+long countRunsBM(Bitmap bm) {
+    long count = 0;
+    word_t carry = 0;
+    long w;
+
+    if (!bm)
+        return 0;
+
+    /* A run starts at every set bit whose lower neighbour is clear */
+    for (w = 0; w < bm->nwords; w++) {
+        word_t word = bm->words[w];
+
+        count += __builtin_popcountll(word & ~((word << 1) | carry));
+        carry = word >> (WORD_BITS - 1);
+    }
+
+    return count;
+}
@@ -0,0 +1,54 @@
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A packed array of bits, one per block. Scans work a 64-bit word
+ * at a time (or four words at a time when built with AVX2).
+ */
+struct bitmap;
+typedef struct bitmap* Bitmap;
+
+/**
+ * Creates a bitmap of the given number of bits, all cleared.
+ */
+Bitmap makeBM(long bits);
+void flushBM(Bitmap);
+
+long sizeOfBM(Bitmap);
+
+int testBM(Bitmap, long i);
+
+/* Sets or clears every bit in [lo, hi) */
+void setRangeBM(Bitmap, long lo, long hi);
+void clearRangeBM(Bitmap, long lo, long hi);
+
+/**
+ * Finds the first set (or clear) bit at or after from.
+ *
+ * return - The index of the bit, or the size of the bitmap if
+ *          there is none.
+ */
+long nextSetBM(Bitmap, long from);
+long nextClearBM(Bitmap, long from);
+
+/* The number of set bits */
+long countSetBM(Bitmap);
+
+/* The number of maximal runs of set bits */
+long countRunsBM(Bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
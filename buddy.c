@@ -0,0 +1,187 @@
+#include "buddy.h"
+
+#include <stdlib.h>
+
+/* Enough orders for any disk addressable by a long */
+#define MAX_ORDERS 63
+
+struct buddy {
+    long blocks;
+    int max_order;
+
+    /* The order of the free chunk headed at a block, or -1 */
+    signed char *order;
+
+    /* Free list links, indexed by chunk head; -1 ends a list */
+    long *next;
+    long *prev;
+
+    /* The first chunk on each free list, or -1 */
+    long heads[MAX_ORDERS];
+};
+
+
+static void pushBuddy(Buddy b, long head, int order) {
+    b->order[head] = order;
+    b->prev[head] = -1;
+    b->next[head] = b->heads[order];
+
+    if (b->heads[order] >= 0)
+        b->prev[b->heads[order]] = head;
+    b->heads[order] = head;
+}
+
+static void unlinkBuddy(Buddy b, long head) {
+    int order = b->order[head];
+
+    if (b->prev[head] >= 0)
+        b->next[b->prev[head]] = b->next[head];
+    else
+        b->heads[order] = b->next[head];
+
+    if (b->next[head] >= 0)
+        b->prev[b->next[head]] = b->prev[head];
+
+    b->order[head] = -1;
+}
+
+/**
+ * The largest aligned chunk that starts at lo and ends by hi.
+ */
+static int chunkOrder(Buddy b, long lo, long hi) {
+    int k = 0;
+
+    while (k < b->max_order
+           && !(lo & (1L << k))
+           && lo + (1L << (k+1)) <= hi)
+        k++;
+
+    return k;
+}
+
+Buddy makeBuddy(long blocks) {
+    Buddy b = (Buddy) malloc(sizeof(struct buddy));
+    long n = blocks > 0 ? blocks : 1;
+    long blk;
+    int k;
+
+    b->blocks = blocks > 0 ? blocks : 0;
+    b->order = (signed char*) malloc(n * sizeof(signed char));
+    b->next = (long*) malloc(n * sizeof(long));
+    b->prev = (long*) malloc(n * sizeof(long));
+
+    for (b->max_order = 0; b->max_order + 1 < MAX_ORDERS
+                           && (1L << (b->max_order + 1)) <= b->blocks; b->max_order++);
+
+    for (k = 0; k < MAX_ORDERS; k++)
+        b->heads[k] = -1;
+    for (blk = 0; blk < n; blk++)
+        b->order[blk] = -1;
+
+    /* Seed the free lists with the largest aligned chunks that fit */
+    for (blk = 0; blk < b->blocks; blk += 1L << k) {
+        k = chunkOrder(b, blk, b->blocks);
+        pushBuddy(b, blk, k);
+    }
+
+    return b;
+}
+
+void flushBuddy(Buddy b) {
+    if (b) {
+        free(b->order);
+        free(b->next);
+        free(b->prev);
+        free(b);
+    }
+}
+
+int orderForBuddy(long n) {
+    int k = 0;
+
+    while ((1L << k) < n && k < MAX_ORDERS - 1)
+        k++;
+
+    return k;
+}
+
+long pickBuddy(Buddy b, int order) {
+    int k;
+
+    for (k = order; k <= b->max_order; k++) {
+        if (b->heads[k] >= 0)
+            return b->heads[k];
+    }
+
+    return -1;
+}
+
+/**
+ * Removes the free aligned chunk of 2^k blocks at blk from the free
+ * lists, splitting whichever larger free chunk contains it.
+ */
+static void carveChunk(Buddy b, long blk, int k) {
+    long head = blk;
+    int j;
+
+    /* Find the free chunk containing blk */
+    for (j = k; j <= b->max_order; j++) {
+        head = blk & ~((1L << j) - 1);
+        if (b->order[head] == j)
+            break;
+    }
+
+    if (j > b->max_order) {
+        /* Covered by smaller chunks; carve each half separately */
+        if (k > 0) {
+            carveChunk(b, blk, k - 1);
+            carveChunk(b, blk + (1L << (k-1)), k - 1);
+        }
+        return;
+    }
+
+    unlinkBuddy(b, head);
+
+    /* Split down, freeing the half that does not hold blk each time */
+    while (j > k) {
+        j--;
+        if (blk & (1L << j)) {
+            pushBuddy(b, head, j);
+            head += 1L << j;
+        } else
+            pushBuddy(b, head + (1L << j), j);
+    }
+}
+
+void carveBuddy(Buddy b, long lo, long hi) {
+    while (lo < hi) {
+        int k = chunkOrder(b, lo, hi);
+
+        carveChunk(b, lo, k);
+        lo += 1L << k;
+    }
+}
+
+void freeBuddy(Buddy b, long lo, long hi) {
+    while (lo < hi) {
+        int k = chunkOrder(b, lo, hi);
+        long head = lo;
+        int j = k;
+
+        lo += 1L << k;
+
+        /* Merge upward while the buddy is a free chunk of equal order */
+        while (j < b->max_order) {
+            long bud = head ^ (1L << j);
+
+            if (bud >= b->blocks || b->order[bud] != j)
+                break;
+
+            unlinkBuddy(b, bud);
+            head &= ~(1L << j);
+            j++;
+        }
+
+        pushBuddy(b, head, j);
+    }
+}
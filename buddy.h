@@ -0,0 +1,59 @@
+#ifndef _BUDDY_H_
+#define _BUDDY_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Buddy-system bookkeeping for a range of blocks. Free space is held
+ * as aligned chunks of 2^k blocks on one free list per order k, and a
+ * chunk is merged with its buddy as soon as both are free. Splitting
+ * and coalescing take O(log n).
+ */
+struct buddy;
+typedef struct buddy* Buddy;
+
+/**
+ * Creates the bookkeeping for blocks [0, blocks), all free.
+ */
+Buddy makeBuddy(long blocks);
+void flushBuddy(Buddy);
+
+/**
+ * The smallest order k such that 2^k >= n.
+ */
+int orderForBuddy(long n);
+
+/**
+ * Chooses the free chunk that a request of the given order should be
+ * carved from: the head of a chunk on the smallest non-empty free list
+ * of at least that order. Nothing is modified.
+ *
+ * return - The first block of the chunk, or -1 if there is none.
+ */
+long pickBuddy(Buddy, int order);
+
+/**
+ * Removes the free blocks [lo, hi) from the free lists, splitting any
+ * chunks that straddle the range and keeping the remainders free.
+ */
+void carveBuddy(Buddy, long lo, long hi);
+
+/**
+ * Returns the allocated blocks [lo, hi) to the free lists, coalescing
+ * with free buddies.
+ */
+void freeBuddy(Buddy, long lo, long hi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
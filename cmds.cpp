@@ -1,23 +1,29 @@
 #include "cmds.h"
 #include "dirtree.h"
 #include "simsys.h"
+#include "pool.h"
+#include "smallvec.h"
+#include "runvec.h"
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 char** str_to_vec(char *str, char split_c) {
-    char** vec = (char**) malloc(sizeof(char*));
+    SmallVec<char*, 16> words;
+    char** vec;
     char *next;
     int i, j, k;
-    int size = 0;
-
-    vec[0] = NULL;
     
     k = 0;
     while (1) {
         int m, n;
-        char **tmp;
         
         for (m = 0, n = 0; str[k+n+m] != split_c && str[k+n+m]; n++) {
             /* Skip backslashes */
@@ -34,19 +40,7 @@ char** str_to_vec(char *str, char split_c) {
         }
         next[n] = '\0';
 
-        vec[size] = next;
-
-        /* Realloc */
-        size++;
-        tmp = (char**) realloc(vec, (size+1) * sizeof(char*));
-        if (!tmp) {
-            printf("Have to reallocate.\n");
-            tmp = (char**) malloc((size+1) * sizeof(char*));
-            memcpy(tmp, vec, size * sizeof(char*));
-        }
-
-        vec = tmp;
-        vec[size] = NULL;
+        words.push_back(next);
         
         /* Update k */
         while (str[k+m+n] == split_c)
@@ -55,10 +49,16 @@ char** str_to_vec(char *str, char split_c) {
         if (str[k+m+n]) 
             k += n+m;
         else
-            return vec;
+            break;
 
     }
 
+    /* One allocation for the NULL-terminated vector */
+    vec = (char**) malloc((words.size() + 1) * sizeof(char*));
+    memcpy(vec, words.data(), words.size() * sizeof(char*));
+    vec[words.size()] = NULL;
+
+    return vec;
 }
 
 void free_str_vec(char **vec) {
@@ -74,7 +74,21 @@ void error_message(char *cmd, char *mssg) {
     printf("%s: Cannot perform operation: %s\n", cmd, mssg);
 }
 
-void printTreeNode(DirTree node, int fullpath, int details) {
+/* Prints the path of a node of root's tree */
+static void printTreePath(DirTree root, DirTree node) {
+    char **path = pathVecIn(root, node);
+    int i;
+
+    /* Print each file layer */
+    for (i = 0; path[i]; i++)
+        printf("%s%s", path[i],
+            path[i+1] ? "/" : ""
+    );
+
+    free_str_vec(path);
+}
+
+void printTreeNode(DirTree node, DirTree root, int details) {
     char *filename;
     char buff[32];
 
@@ -114,19 +128,9 @@ void printTreeNode(DirTree node, int fullpath, int details) {
     if (!is_file)
         printf("\033[1m\033[34m");
 
-    if (fullpath) {
+    if (root) {
         /* Show full path */
-        char **path = pathVecOfTree(node);
-        int i;
-        
-        /* Print each file layer */
-        for (i = 0; path[i]; i++)
-            printf("%s%s", path[i],
-                path[i+1] ? "/" : ""
-        );
-
-        free_str_vec(path);
-
+        printTreePath(root, node);
     } else
         printf("%s", filename);
     
@@ -176,6 +180,16 @@ void cmd_exec(char *argv[]) {
         cmd = cmd_append;
     else if (!strcmp(name, "remove"))
         cmd = cmd_remove;
+    else if (!strcmp(name, "truncate"))
+        cmd = cmd_truncate;
+    else if (!strcmp(name, "write"))
+        cmd = cmd_write;
+    else if (!strcmp(name, "read"))
+        cmd = cmd_read;
+    else if (!strcmp(name, "prealloc"))
+        cmd = cmd_prealloc;
+    else if (!strcmp(name, "trim"))
+        cmd = cmd_trim;
     else if (!strcmp(name, "delete"))
         cmd = cmd_delete;
     else if (!strcmp(name, "exit"))
@@ -184,6 +198,20 @@ void cmd_exec(char *argv[]) {
         cmd = cmd_dir;
     else if (!strcmp(name, "prfiles"))
         cmd = cmd_prfiles;
+    else if (!strcmp(name, "prdisk"))
+        cmd = cmd_prdisk;
+    else if (!strcmp(name, "defrag"))
+        cmd = cmd_defrag;
+    else if (!strcmp(name, "blkowner"))
+        cmd = cmd_blkowner;
+    else if (!strcmp(name, "clone"))
+        cmd = cmd_clone;
+    else if (!strcmp(name, "snapshot"))
+        cmd = cmd_snapshot;
+    else if (!strcmp(name, "sync"))
+        cmd = cmd_sync;
+    else if (!strcmp(name, "prmem"))
+        cmd = cmd_prmem;
     else if (!strcmp(name, "cd..")) {
         char *args[3];
         args[0] = "cd";
@@ -205,16 +233,17 @@ int cmd_cd(char *argv[]) {
     
     if (!argv[1]) {
         /* Default is to go to root. */
-        setWorkDirNode(getRootNode());
+        setWorkDirNode(getRootNode(), getRootNode());
         return 0;
     } else while (argv[i]) {
-        DirTree tgt;
+        DirTree tgt, root;
 
         /* Build a token vector */
         dirtoks = str_to_vec(argv[i], '/');
 
-        /* Get the destination */
+        /* Get the destination, and the tree it is in */
         tgt = getRelTree(getWorkDirNode(), dirtoks);
+        root = getRelRoot(dirtoks);
 
         /* Free the vector */
         free_str_vec(dirtoks);
@@ -226,7 +255,7 @@ int cmd_cd(char *argv[]) {
             printf("cd: %s: Target is not a directory\n", argv[i]);
             return 1;
         } else {
-            setWorkDirNode(tgt);
+            setWorkDirNode(root, tgt);
         }
 
         i++;
@@ -259,24 +288,25 @@ int cmd_ls(char *argv[]) {
         printf("ls: cannot access '%s': Target is not a directory.\n", argv[1]);
         return 1;
     } else {
-        LList files = getDirTreeChildren(tgt, 1);
-
-        printf("total %i\n", sizeOfLL(files));
-        
-        /* Go through each file, removing from the list as it goes */
-        while (!isEmptyLL(files)) {
-            DirTree file = (DirTree) remFromLL(files, 0);
+        ChildView files;
+        DirTree file;
 
-            printTreeNode(file, 0, 1);
-        }
+        printf("total %li\n", numDirChildren(tgt));
         
-        /* Delete the list */
-        free(files);
+        /* Go through each file, in name order */
+        viewDirChildren(tgt, &files);
+        while ((file = nextDirChild(&files)))
+            printTreeNode(file, NULL, 1);
     }
     
     return 0;
 }
 
+/* Whether a new name would be read as a snapshot in paths */
+static int isSnapshotName(char *name) {
+    return name[0] == '@';
+}
+
 /**
  * Creates a directory, or set of directories.
  */
@@ -294,14 +324,14 @@ int cmd_mkdir(char *argv[]) {
             /* Build a path */
             char **path = str_to_vec(argv[i], '/');
             char *dirnm;
-            int j, k;
+            int k, exists;
             DirTree tgtDir;
-            LList files;
 
             /* Check whether or not the file already exists */
             if (getRelTree(getWorkDirNode(), path)) {
                 printf("mkdir: Cannot create directory '%s': Already exists\n", argv[i]);
                 errCode = 1;
+                free_str_vec(path);
                 i++;
                 continue;
             }
@@ -318,35 +348,43 @@ int cmd_mkdir(char *argv[]) {
                 /* The containing path does not exist. */
                 printf("mkdir: cannot create directory '%s': No such file or directory\n", argv[i]);
                 errCode = 1;
+                path[k-1] = dirnm;
+                free_str_vec(path);
+                i++;
+                continue;
+            } else if (isReadOnly(path)) {
+                printf("mkdir: cannot create directory '%s': Read-only snapshot\n", argv[i]);
+                errCode = 1;
+                path[k-1] = dirnm;
+                free_str_vec(path);
+                i++;
+                continue;
+            } else if (isSnapshotName(dirnm)) {
+                printf("mkdir: cannot create directory '%s': Names starting with '@' are snapshots\n", argv[i]);
+                errCode = 1;
+                path[k-1] = dirnm;
+                free_str_vec(path);
                 i++;
                 continue;
             }
 
-            files = getDirTreeChildren(tgtDir, 0);
-
-            for (j = sizeOfLL(files) - 1; j >= 0; j--) {
-                DirTree file = (DirTree) getFromLL(files, j);
+            exists = findDirChild(tgtDir, dirnm) != NULL;
 
-                if (!strcmp(getTreeFilename(file), argv[i])) {
-                    /* Don't make duplicate directories */
-                    printf("mkdir: cannot create directory '%s': Already exists\n", argv[i]);
-                    errCode = 1;
-                    break;
-                }
+            if (exists) {
+                /* Don't make duplicate directories */
+                printf("mkdir: cannot create directory '%s': Already exists\n", argv[i]);
+                errCode = 1;
             }
 
             path[k-1] = dirnm;
             
-            if (j < 0) {
+            if (!exists) {
                 /* Add the directory */
-                addDirToTree(getWorkDirNode(), path);
+                addDirToTree(writableTree(tgtDir), &path[k-1]);
             }
 
             /* Free used memory */
             free_str_vec(path);
-            while (!isEmptyLL(files))
-                remFromLL(files, 0);
-            free(files);
 
             i++;
         }
@@ -373,14 +411,14 @@ int cmd_create(char *argv[]) {
             /* Build a path */
             char **path = str_to_vec(argv[i], '/');
             char *filenm;
-            int j, k;
+            int k, exists;
             DirTree tgtDir;
-            LList files;
 
             /* Check whether or not the file already exists */
             if (getRelTree(getWorkDirNode(), path)) {
                 printf("mkdir: cannot make file '%s': Already exists\n", argv[i]);
                 errCode = 1;
+                free_str_vec(path);
                 i++;
                 continue;
             }
@@ -399,36 +437,43 @@ int cmd_create(char *argv[]) {
             if (!tgtDir) {
                 printf("mkdir: cannot create file '%s': No such file or directory\n", argv[i]);
                 errCode = 1;
+                path[k-1] = filenm;
+                free_str_vec(path);
+                i++;
+                continue;
+            } else if (isReadOnly(path)) {
+                printf("create: cannot create file '%s': Read-only snapshot\n", argv[i]);
+                errCode = 1;
+                path[k-1] = filenm;
+                free_str_vec(path);
+                i++;
+                continue;
+            } else if (isSnapshotName(filenm)) {
+                printf("create: cannot create file '%s': Names starting with '@' are snapshots\n", argv[i]);
+                errCode = 1;
+                path[k-1] = filenm;
+                free_str_vec(path);
                 i++;
                 continue;
             }
 
-            files = getDirTreeChildren(tgtDir, 0);
-
-
-            for (j = sizeOfLL(files) - 1; j >= 0; j--) {
-                DirTree file = (DirTree) getFromLL(files, j);
+            exists = findDirChild(tgtDir, filenm) != NULL;
 
-                if (!strcmp(getTreeFilename(file), argv[i])) {
-                    /* Don't make duplicate directories */
-                    printf("create: cannot create file %s: Already exists.\n", argv[i]);
-                    errCode = 1;
-                    break;
-                }
+            if (exists) {
+                /* Don't make duplicate files */
+                printf("create: cannot create file %s: Already exists.\n", argv[i]);
+                errCode = 1;
             }
 
             path[k-1] = filenm;
             
-            if (j < 0) {
-                /* Add the directory */
-                addFileToTree(getWorkDirNode(), path);
+            if (!exists) {
+                /* Add the file */
+                addFileToTree(writableTree(tgtDir), &path[k-1]);
             }
 
             /* Free used memory */
             free_str_vec(path);
-            while (!isEmptyLL(files))
-                remFromLL(files, 0);
-            free(files);
 
             i++;
         }
@@ -447,11 +492,17 @@ int cmd_append(char *argv[]) {
         
         char **path = str_to_vec(argv[1], '/');
         DirTree tgt = getRelTree(getWorkDirNode(), path);
+        int readOnly = isReadOnly(path);
         long request = atol(argv[2]);
+
+        free_str_vec(path);
         
         if (!tgt) {
             errCode = 1;
             printf("append: cannot modify '%s': No such file\n", argv[1]);
+        } else if (readOnly) {
+            errCode = 1;
+            printf("append: cannot modify '%s': Read-only snapshot\n", argv[1]);
         } else if (request <= 0) {
             errCode = 1;
             printf("append: cannot append nonpositive memory\n");
@@ -462,6 +513,7 @@ int cmd_append(char *argv[]) {
             long fileSizeAfter;
             long blocksNeeded;
 
+            tgt = writableTree(tgt);
             fileSizeBefore = treeFileSize(tgt, NULL);
             fileSizeAfter = fileSizeBefore + request;
 
@@ -470,21 +522,26 @@ int cmd_append(char *argv[]) {
                             ? ((fileSizeAfter - 1) / blockSize() - (fileSizeBefore - 1) / blockSize())
                             : (1 + (fileSizeAfter - 1) / blockSize());
 
-            /* Update the file */
-            if (enoughMemFor(blocksNeeded)) {
+            /* Preallocated blocks are used before any new ones */
+            long blocksReady = preallocatedBlocks(tgt);
 
-                printf("Allocating %ld bytes (needs %ld blocks)...\n", request, blocksNeeded);
+            if (blocksReady > blocksNeeded)
+                blocksReady = blocksNeeded;
 
-                /* Allocate blocks */
-                while (blocksNeeded > 0) {
-                    assignMemoryBlock(tgt, allocBlock());
-                    blocksNeeded--;
-                }
+            /* Update the file */
+            if (!growFile(tgt, blocksNeeded)) {
+
+                if (blocksReady == blocksNeeded && blocksReady)
+                    printf("Allocating %ld bytes (%ld blocks preallocated)...\n", request, blocksReady);
+                else if (delayedAllocThreshold())
+                    printf("Reserving %ld bytes (%ld blocks deferred)...\n", request, blocksNeeded - blocksReady);
+                else
+                    printf("Allocating %ld bytes (needs %ld blocks)...\n", request, blocksNeeded - blocksReady);
 
                 updateFileSize(tgt, fileSizeAfter);
 
                 updateTimestamp(tgt);
-                updateTimestamp(getTreeParent(tgt));
+                updateTimestamp(getTreeParent(getRootNode(), tgt));
 
             } else {
                 errCode = 1;
@@ -501,6 +558,26 @@ int cmd_append(char *argv[]) {
     }
 }
 
+/* Orders runs by their first block */
+static bool startsBefore(const Extent &a, const Extent &b) {
+    return a.start < b.start;
+}
+
+/* Cuts a file off at logical block from, dropping its last n blocks */
+void revokeFileBlocks(DirTree file, long from, long n) {
+    RunList runs;
+
+    /* Blocks that were never allocated go first */
+    cancelDelayedBlocks(file, n);
+
+    /* The rest are freed together, in disk order. Holes cost nothing,
+       and a handful of runs never leave the stack. */
+    if (releaseMemoryFrom(file, from, asRunVec(runs))) {
+        std::sort(runs.begin(), runs.end(), startsBefore);
+        freeBlocks(runs.data(), runs.size());
+    }
+}
+
 int cmd_remove(char *argv[]) {
     if (!argv[1] || !argv[2]) {
         printf("remove: missing operand\n");
@@ -510,12 +587,18 @@ int cmd_remove(char *argv[]) {
         
         char **path = str_to_vec(argv[1], '/');
         DirTree tgt = getRelTree(getWorkDirNode(), path);
+        int readOnly = isReadOnly(path);
 
         long request = atol(argv[2]);
+
+        free_str_vec(path);
         
         if (!tgt) {
             errCode = 1;
             printf("remove: cannot modify '%s': No such file\n", argv[1]);
+        } else if (readOnly) {
+            errCode = 1;
+            printf("remove: cannot modify '%s': Read-only snapshot\n", argv[1]);
         } else if (request <= 0) {
             errCode = 1;
             printf("remove: cannot remove nonpositive memory\n");
@@ -526,6 +609,7 @@ int cmd_remove(char *argv[]) {
             long fileSizeAfter;
             long blocksNeeded;
 
+            tgt = writableTree(tgt);
             fileSizeBefore = treeFileSize(tgt, NULL);
             fileSizeAfter = fileSizeBefore - request;
 
@@ -539,17 +623,19 @@ int cmd_remove(char *argv[]) {
                 errCode = 1;
                 printf("remove: cannot modify '%s': More blocks requested for deletion than exist\n", argv[1]);
             } else {
-                printf("Deallocating %ld bytes (revoking %ld blocks)...\n", request, blocksNeeded);
-                
+                /* Holes in a sparse file have nothing to revoke */
+                long held = getTreeBlockCount(tgt) + getDelayedBlocks(tgt);
+
                 /* Deallocate the blocks */
-                while (blocksNeeded > 0) {
-                    freeBlock(releaseMemoryBlock(tgt));
-                    blocksNeeded--;
-                }
+                revokeFileBlocks(tgt, (fileSizeBefore + blockSize() - 1) / blockSize() - blocksNeeded,
+                    blocksNeeded);
+
+                printf("Deallocating %ld bytes (revoking %ld blocks)...\n", request,
+                    held - getTreeBlockCount(tgt) - getDelayedBlocks(tgt));
 
                 updateFileSize(tgt, fileSizeAfter);
                 updateTimestamp(tgt);
-                updateTimestamp(getTreeParent(tgt));
+                updateTimestamp(getTreeParent(getRootNode(), tgt));
             }
 
         } else {
@@ -562,6 +648,382 @@ int cmd_remove(char *argv[]) {
 }
 
 
+int cmd_truncate(char *argv[]) {
+    /* With --extend, the file only grows, and sparsely */
+    int extend = argv[1] && !strcmp(argv[1], "--extend");
+
+    if (extend)
+        argv++;
+
+    if (!argv[1] || !argv[2]) {
+        printf("truncate: missing operand\n");
+        return 1;
+    } else {
+        int errCode = 0;
+        
+        char **path = str_to_vec(argv[1], '/');
+        DirTree tgt = getRelTree(getWorkDirNode(), path);
+        int readOnly = isReadOnly(path);
+        long fileSizeAfter = atol(argv[2]);
+
+        free_str_vec(path);
+        
+        if (!tgt) {
+            errCode = 1;
+            printf("truncate: cannot modify '%s': No such file\n", argv[1]);
+        } else if (readOnly) {
+            errCode = 1;
+            printf("truncate: cannot modify '%s': Read-only snapshot\n", argv[1]);
+        } else if (fileSizeAfter < 0) {
+            errCode = 1;
+            printf("truncate: cannot set a negative size\n");
+        } else if (isTreeFile(tgt)) {
+
+            long fileSizeBefore = treeFileSize(tgt, NULL);
+
+            /* Ceiling divisions give the block count at each size */
+            long blocksBefore = (fileSizeBefore + blockSize() - 1) / blockSize();
+            long blocksAfter = (fileSizeAfter + blockSize() - 1) / blockSize();
+
+            tgt = writableTree(tgt);
+
+            if (extend) {
+                if (fileSizeAfter < fileSizeBefore) {
+                    printf("truncate: cannot extend '%s': File is already larger\n", argv[1]);
+                    return 1;
+                }
+
+                /* Reserved blocks belong at the old end, so place them now */
+                flushFileBlocks(tgt);
+
+                /* Preallocated blocks simply come into the file */
+                blocksBefore += preallocatedBlocks(tgt);
+                if (blocksBefore > blocksAfter)
+                    blocksBefore = blocksAfter;
+
+                printf("Extending to %ld bytes (%ld blocks left unallocated)...\n",
+                    fileSizeAfter, blocksAfter - blocksBefore);
+            } else if (blocksAfter < blocksBefore) {
+                /* Holes in a sparse file have nothing to revoke */
+                long held = getTreeBlockCount(tgt) + getDelayedBlocks(tgt);
+
+                revokeFileBlocks(tgt, blocksAfter, blocksBefore - blocksAfter);
+                printf("Truncating to %ld bytes (revoking %ld blocks)...\n",
+                    fileSizeAfter, held - getTreeBlockCount(tgt) - getDelayedBlocks(tgt));
+            } else if (blocksAfter > blocksBefore) {
+                if (growFile(tgt, blocksAfter - blocksBefore)) {
+                    printf("truncate: cannot modify '%s': Insufficient memory space to allocate %ld blocks\n",
+                        argv[1], blocksAfter - blocksBefore);
+                    return 1;
+                }
+                printf("Extending to %ld bytes (needs %ld blocks)...\n",
+                    fileSizeAfter, blocksAfter - blocksBefore);
+            }
+
+            updateFileSize(tgt, fileSizeAfter);
+            updateTimestamp(tgt);
+            updateTimestamp(getTreeParent(getRootNode(), tgt));
+
+        } else {
+            errCode = 1;
+            printf("truncate: cannot modify '%s': Not a file\n", argv[1]);
+        }
+
+        return errCode;
+    }
+}
+
+/* Milliseconds of wall time since start */
+static double elapsedMs(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Prints the rate of a copy through the disk image */
+static void printThroughput(long bytes, double ms) {
+    printf("Copied %ld bytes in %.3f ms", bytes, ms);
+    if (ms > 0)
+        printf(" (%.1f MB/s)", bytes / ms / 1e3);
+    printf("\n");
+}
+
+int cmd_write(char *argv[]) {
+    /* With --from, the data comes from a host file */
+    char *host = NULL;
+
+    if (argv[1] && !strcmp(argv[1], "--from")) {
+        host = argv[2];
+        argv += host ? 2 : 1;
+    }
+
+    if (!argv[1] || !argv[2] || (!host && !argv[3])) {
+        printf("write: missing operand\n");
+        return 1;
+    } else {
+        int errCode = 0;
+        
+        char **path = str_to_vec(argv[1], '/');
+        DirTree tgt = getRelTree(getWorkDirNode(), path);
+        int readOnly = isReadOnly(path);
+        long offset = atol(argv[2]);
+        long request = host ? 0 : atol(argv[3]);
+        int fd = -1;
+
+        free_str_vec(path);
+
+        if (host) {
+            struct stat st;
+
+            if (!hasDiskImage()) {
+                printf("write: no disk image to hold the data\n");
+                return 1;
+            }
+
+            fd = open(host, O_RDONLY);
+            if (fd < 0 || fstat(fd, &st)) {
+                printf("write: cannot read '%s'\n", host);
+                if (fd >= 0)
+                    close(fd);
+                return 1;
+            }
+            request = st.st_size;
+        }
+        
+        if (!tgt) {
+            errCode = 1;
+            printf("write: cannot modify '%s': No such file\n", argv[1]);
+        } else if (readOnly) {
+            errCode = 1;
+            printf("write: cannot modify '%s': Read-only snapshot\n", argv[1]);
+        } else if (offset < 0 || request <= 0) {
+            errCode = 1;
+            printf("write: invalid offset or length\n");
+        } else if (isTreeFile(tgt)) {
+
+            /* The logical blocks the write touches */
+            long lo = offset / blockSize();
+            long hi = (offset + request + blockSize() - 1) / blockSize();
+            long allocated;
+
+            tgt = writableTree(tgt);
+            allocated = fillFileBlocks(tgt, lo, hi);
+
+            if (allocated < 0) {
+                printf("write: cannot modify '%s': Insufficient memory space to fill blocks %ld-%ld\n",
+                    argv[1], lo, hi - 1);
+                if (fd >= 0)
+                    close(fd);
+                return 1;
+            }
+
+            printf("Writing %ld bytes at %ld (allocating %ld blocks)...\n", request, offset, allocated);
+
+            if (host) {
+                struct timespec start;
+                long copied;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                copied = writeFileData(tgt, offset, fd, request);
+
+                if (copied < 0) {
+                    errCode = 1;
+                    printf("write: cannot read '%s'\n", host);
+                    copied = 0;
+                } else
+                    printThroughput(copied, elapsedMs(&start));
+
+                /* Only what was copied counts towards the size */
+                request = copied;
+            }
+
+            /* Writing past the end grows the file */
+            if (offset + request > treeFileSize(tgt, NULL))
+                updateFileSize(tgt, offset + request);
+
+            updateTimestamp(tgt);
+            updateTimestamp(getTreeParent(getRootNode(), tgt));
+
+        } else {
+            errCode = 1;
+            printf("write: cannot modify '%s': Not a file\n", argv[1]);
+        }
+
+        if (fd >= 0)
+            close(fd);
+
+        return errCode;
+    }
+}
+
+int cmd_read(char *argv[]) {
+    if (!argv[1] || !argv[2] || !argv[3]) {
+        printf("read: missing operand\n");
+        return 1;
+    } else if (!hasDiskImage()) {
+        printf("read: no disk image holding any data\n");
+        return 1;
+    } else {
+        int errCode = 0;
+        
+        char **path = str_to_vec(argv[1], '/');
+        DirTree tgt = getRelTree(getWorkDirNode(), path);
+        long offset = atol(argv[2]);
+        long request = atol(argv[3]);
+
+        free_str_vec(path);
+        
+        if (!tgt) {
+            errCode = 1;
+            printf("read: cannot read '%s': No such file\n", argv[1]);
+        } else if (offset < 0 || request < 0) {
+            errCode = 1;
+            printf("read: invalid offset or length\n");
+        } else if (isTreeFile(tgt)) {
+            /* The data goes to a host file if one is named, else to stdout */
+            int fd = argv[4] ? open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+            struct timespec start;
+            long copied;
+
+            if (fd < 0) {
+                printf("read: cannot write '%s'\n", argv[4]);
+                return 1;
+            }
+
+            /* Nothing is read past the end of the file */
+            if (offset >= treeFileSize(tgt, NULL))
+                request = 0;
+            else if (offset + request > treeFileSize(tgt, NULL))
+                request = treeFileSize(tgt, NULL) - offset;
+
+            fflush(stdout);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            copied = readFileData(tgt, offset, fd, request);
+
+            if (argv[4])
+                close(fd);
+            else
+                printf("\n");
+
+            if (copied < 0) {
+                errCode = 1;
+                printf("read: cannot write '%s'\n", argv[4] ? argv[4] : "stdout");
+            } else
+                printThroughput(copied, elapsedMs(&start));
+
+        } else {
+            errCode = 1;
+            printf("read: cannot read '%s': Not a file\n", argv[1]);
+        }
+
+        return errCode;
+    }
+}
+
+int cmd_prealloc(char *argv[]) {
+    if (!argv[1] || !argv[2]) {
+        printf("prealloc: missing operand\n");
+        return 1;
+    } else {
+        int errCode = 0;
+        
+        char **path = str_to_vec(argv[1], '/');
+        DirTree tgt = getRelTree(getWorkDirNode(), path);
+        int readOnly = isReadOnly(path);
+        long request = atol(argv[2]);
+
+        free_str_vec(path);
+        
+        if (!tgt) {
+            errCode = 1;
+            printf("prealloc: cannot modify '%s': No such file\n", argv[1]);
+        } else if (readOnly) {
+            errCode = 1;
+            printf("prealloc: cannot modify '%s': Read-only snapshot\n", argv[1]);
+        } else if (request <= 0) {
+            errCode = 1;
+            printf("prealloc: cannot preallocate nonpositive memory\n");
+        } else if (isTreeFile(tgt)) {
+
+            /* The blocks an append of the same size would need */
+            long fileSize = treeFileSize(tgt, NULL);
+            long blocksNeeded = (fileSize + request + blockSize() - 1) / blockSize()
+                                - (fileSize + blockSize() - 1) / blockSize();
+            long allocated;
+
+            tgt = writableTree(tgt);
+            allocated = preallocFile(tgt, blocksNeeded);
+
+            if (allocated < 0) {
+                printf("prealloc: cannot modify '%s': Insufficient memory space to allocate %ld blocks\n",
+                    argv[1], blocksNeeded);
+                return 1;
+            }
+
+            printf("Preallocating %ld bytes (allocating %ld blocks)...\n", request, allocated);
+
+            updateTimestamp(tgt);
+
+        } else {
+            errCode = 1;
+            printf("prealloc: cannot modify '%s': Not a file\n", argv[1]);
+        }
+
+        return errCode;
+    }
+}
+
+int cmd_trim(char *argv[]) {
+    if (!argv[1]) {
+        printf("trim: missing operand\n");
+        return 1;
+    } else {
+        int errCode = 0;
+        int i = 1;
+        
+        while (argv[i]) {
+            char **path = str_to_vec(argv[i], '/');
+            DirTree tgt = getRelTree(getWorkDirNode(), path);
+            
+            if (!tgt) {
+                errCode = 1;
+                printf("trim: cannot modify '%s': No such file\n", argv[i]);
+            } else if (isReadOnly(path)) {
+                errCode = 1;
+                printf("trim: cannot modify '%s': Read-only snapshot\n", argv[i]);
+            } else if (isTreeFile(tgt)) {
+                long n = preallocatedBlocks(tgt);
+
+                /* Only the blocks past the end of the file go */
+                tgt = writableTree(tgt);
+                printf("Trimming '%s' (revoking %ld blocks)...\n", argv[i], n);
+                revokeFileBlocks(tgt, (treeFileSize(tgt, NULL) + blockSize() - 1) / blockSize(), 0);
+            } else {
+                errCode = 1;
+                printf("trim: cannot modify '%s': Not a file\n", argv[i]);
+            }
+
+            free_str_vec(path);
+            i++;
+        }
+
+        return errCode;
+    }
+}
+
+/* Removes a node of the live tree, once its path is writable */
+static int unlinkTreeNode(DirTree node) {
+    DirTree parent = getTreeParent(getRootNode(), node);
+    char *name[2];
+
+    name[0] = getTreeFilename(node);
+    name[1] = NULL;
+
+    return isTreeFile(node) ? rmfileFromTree(parent, name) : rmdirFromTree(parent, name);
+}
+
 int cmd_delete(char *argv[]) {
     if (!argv[1]) {
         printf("rm: missing operand\n");
@@ -581,39 +1043,30 @@ int cmd_delete(char *argv[]) {
             } else if (!tgt) {
                 errCode = 1;
                 printf("delete: cannot delete '%s': No such file or directory\n", argv[i]);
+            } else if (isReadOnly(path)) {
+                errCode = 1;
+                printf("delete: cannot delete '%s': Read-only snapshot\n", argv[i]);
             } else if (isTreeFile(tgt)) {
-                /* The currently allocated memory blocks */
-                LList blocks = getTreeFileBlocks(tgt);
-                
-                /* Free each used memory block one by one */
-                while (!isEmptyLL(blocks)) {
-                    long *blk = (long*) remFromLL(blocks, 0);
-                    freeBlock(*blk);
-                    free(blk);
-                }
-                free(blocks);
-                
+                /* Reserved blocks are given up, the rest freed at once */
+                tgt = writableTree(tgt);
+                revokeFileBlocks(tgt, 0, getDelayedBlocks(tgt));
+
                 /* Remove the file */
-                errCode |= rmfileFromTree(tgt, NULL);
+                errCode |= unlinkTreeNode(tgt) != 0;
 
             } else {
                 /* Handle directory removal. */
-                LList children = getDirTreeChildren(tgt, 0);
                 
                 /* Allow deletion if the directory is empty */
-                if (isEmptyLL(children))
-                    errCode |= rmdirFromTree(tgt, NULL);
+                if (!numDirChildren(tgt))
+                    errCode |= unlinkTreeNode(writableTree(tgt)) != 0;
                 else {
                     errCode = 1;
                     printf("delete: failed to remove '%s': Directory not empty\n", argv[i]);
                 }
-                
-                /* Free the child list */
-                while(!isEmptyLL(children))
-                    remFromLL(children, 0);
-                free(children);
             }
 
+            free_str_vec(path);
             i++;
 
         }
@@ -640,10 +1093,15 @@ int cmd_exit(char *argv[]) {
 
 }
 
+/* Prints one line of a dir listing; arg is the root of the tree */
+static int printDirEntry(DirTree node, void *arg) {
+    printTreeNode(node, (DirTree) arg, 0);
+    return 0;
+}
+
 int cmd_dir(char *argv[]) {
     
-    DirTree root;
-    LList bfs_list = makeLL();
+    DirTree root, tree = getWorkRootNode();
     
     /* Get the top directory of the BFS */
     if (!argv[1])
@@ -651,87 +1109,72 @@ int cmd_dir(char *argv[]) {
     else {
         char **dirtoks = str_to_vec(argv[1], '/');
         root = getRelTree(getWorkDirNode(), dirtoks);
+        tree = getRelRoot(dirtoks);
         free_str_vec(dirtoks);
     }
-    
-    /* Initial value is the root */
-    appendToLL(bfs_list, root);
-    
-    while (!isEmptyLL(bfs_list)) {
-        DirTree curr = (DirTree) remFromLL(bfs_list, 0);
-        
-        /* Print the front file */
-        printTreeNode(curr, 1, 0);
-        
-        if (!isTreeFile(curr)) {
-            /* Is a directory; add all children */
-            LList children = getDirTreeChildren(curr, 1);
-
-            while (!isEmptyLL(children))
-                appendToLL(bfs_list, remFromLL(children, 0));
-
-            free(children);
-
-        }
 
+    if (!root) {
+        printf("dir: cannot access '%s': No such file or directory\n", argv[1]);
+        return 1;
     }
-
-    free(bfs_list);
+    
+    walkDirTree(root, printDirEntry, tree);
 
     return 0;
     
 }
 
-/* Used for nlogn sort of longs */
-void mergesort_longs(long *list, int lo, int hi) {
-    if (hi - lo == 2) {
-        /* Pair case */
-        if (list[lo] > list[lo+1]) {
-            long tmp = list[lo];
-            list[lo] = list[lo+1];
-            list[lo+1] = tmp;
-        }
-    } else if (hi - lo > 2) {
-        long *tmp;
+/**
+ * Prints a file's entry and its block map; directories print nothing.
+ * arg is the root of the tree.
+ */
+static int printFileBlocks(DirTree curr, void *arg) {
+    long num_ext;
+    Extent *ext;
+    long num_blks, end;
+    long i, off = 0;
 
-        int c = (lo + hi) / 2;
+    if (!isTreeFile(curr))
+        return 0;
 
-        int i = lo;
-        int j = c;
-        int k = 0;
+    /* Get block information */
+    ext = getTreeFileExtents(curr, &num_ext);
+    num_blks = getTreeBlockCount(curr);
+    end = (treeFileSize(curr, NULL) + blockSize() - 1) / blockSize() - getDelayedBlocks(curr);
+    
+    /* Print basic file data */
+    printTreeNode(curr, (DirTree) arg, 1);
 
-        mergesort_longs(list, lo, c);
-        mergesort_longs(list, c, hi);
-        
-        tmp = (long*) malloc((hi - lo) * sizeof(long));
-        
-        /* Build sorted into the temporary array */
-        while (i < c && j < hi) {
-            if (list[i] < list[j])
-                tmp[k++] = list[i++];
-            else
-                tmp[k++] = list[j++];
-        }
-        
-        while (j < hi)
-            tmp[k++] = list[j++];
+    if (getDelayedBlocks(curr))
+        printf("(%ld blocks awaiting allocation) ", getDelayedBlocks(curr));
+    if (preallocatedBlocks(curr))
+        printf("(%ld blocks preallocated) ", preallocatedBlocks(curr));
 
-        while (i < c)
-            tmp[k++] = list[i++];
+    printf("%ld blocks%s", num_blks, num_blks ? ": " : "");
 
-        /* Reinsert */
-        while (k--)
-            list[lo+k] = tmp[k];
+    /* Print each run, in the order the file uses them, and any holes */
+    for (i = 0; i < num_ext; i++) {
+        if (ext[i].offset > off)
+            printf(" (hole of %ld)", ext[i].offset - off);
 
-        free(tmp);
+        if (ext[i].len == 1)
+            printf(" %ld", ext[i].start);
+        else
+            printf(" %ld-%ld", ext[i].start, ext[i].start + ext[i].len - 1);
 
+        off = ext[i].offset + ext[i].len;
     }
 
+    if (end > off)
+        printf(" (hole of %ld)", end - off);
+
+    printf("\n\n");
+
+    return 0;
 }
 
 int cmd_prfiles(char *argv[]) {
-    DirTree root;
-    LList bfs_list = makeLL();
+    DirTree root, tree = getWorkRootNode();
     
     /* Get the top directory of the BFS */
     if (!argv[1])
@@ -739,93 +1182,313 @@ int cmd_prfiles(char *argv[]) {
     else {
         char **dirtoks = str_to_vec(argv[1], '/');
         root = getRelTree(getWorkDirNode(), dirtoks);
+        tree = getRelRoot(dirtoks);
         free_str_vec(dirtoks);
     }
+
+    if (!root) {
+        printf("prfiles: cannot access '%s': No such file or directory\n", argv[1]);
+        return 1;
+    }
     
-    appendToLL(bfs_list, root);
+    walkDirTree(root, printFileBlocks, tree);
 
-    while (!isEmptyLL(bfs_list)) {
-        DirTree curr = (DirTree) remFromLL(bfs_list, 0);
-                        
-        /* Breadth-first recursive definition */
-        if (!isTreeFile(curr)) {
-            /* Is a directory; add all children */
-            LList children = getDirTreeChildren(curr, 1);
+    return 0;
 
-            while (!isEmptyLL(children))
-                appendToLL(bfs_list, remFromLL(children, 0));
+}
 
-            free(children);
+/**
+ * Prints the disk as alternating runs of allocated and free blocks,
+ * followed by a fragmentation summary. The runs are streamed straight
+ * from the allocator, so memory use does not grow with the disk.
+ */
+int cmd_prdisk(char *argv[]) {
+    long total = numBlocks();
+    long blk = 0;
 
-        } else {
-            /* Get block information */
-            LList blocks = getTreeFileBlocks(curr);
-            int num_blks = sizeOfLL(blocks);
+    long freeRuns = 0, largestFree = 0;
 
-            /* Used as a scratch space for printing. */
-            long *blks = (long*) malloc(num_blks * sizeof(long));
-            int i;
-            
-            /* For printing */
-            int contig = 0;
+    (void) argv;
 
-            /* Iterator */
-            LLiter iter;
-            
-            /* Print basic file data */
-            printTreeNode(curr, 1, 1);
-            
-            /* Dequeue each block number */
-            iter = makeLLiter(blocks);
-            for (i = 0; iterHasNextLL(iter); i++)
-                blks[i] = *((long*) iterNextLL(iter));
+    printf("%ld blocks of %ldB (%s allocator)\n", total, blockSize(), allocatorName());
 
-            free(blocks);
-            disposeIterLL(iter);
+    while (blk < total) {
+        /* Each step covers one run, allocated or free */
+        int used = nextUsedBlock(blk) == blk;
+        long end = used ? nextFreeBlock(blk) : nextUsedBlock(blk);
 
-            printf("%i blocks%s", num_blks, num_blks ? ": " : "");
-            
-            /* Sort the blocks */
-            mergesort_longs(blks, 0, num_blks);
-
-            for (i = 0; i < num_blks; i++) {
-
-                /* Format print the blocks. */
-                if (i > 0 && blks[i] - 1 == blks[i-1]) {
-                    if (!contig) {
-                        printf("-");
-                        contig = 1;
-                    } 
-                } else {
-                    if (contig) {
-                        printf("%ld %ld", blks[i-1], blks[i]);
-                        contig = 0;
-                    } else
-                        printf(" %ld", blks[i]);
-                }
-            }
-            
-            /* Print the last value if necessary */
-            if (contig)
-                printf("%ld", blks[i-1]);
+        if (used)
+            printf("In use: ");
+        else {
+            printf("Free:   ");
+            freeRuns++;
+            if (end - blk > largestFree)
+                largestFree = end - blk;
+        }
+
+        if (end - blk == 1)
+            printf("%ld\n", blk);
+        else
+            printf("%ld-%ld\n", blk, end - 1);
+
+        blk = end;
+    }
+
+    printf("\n%ld blocks in use in %ld sectors, %ld free in %ld runs\n",
+        blocksAllocated(), numSectors(), blocksFree(), freeRuns);
+
+    if (blocksReserved())
+        printf("%ld free blocks reserved for delayed allocation\n", blocksReserved());
+
+    /* External fragmentation: how much free space is outside the largest run */
+    if (blocksFree())
+        printf("Largest free run: %ld blocks; fragmentation %.1f%%\n",
+            largestFree, 100.0 * (blocksFree() - largestFree) / blocksFree());
 
-            printf("\n\n");
+    return 0;
+}
+
+/**
+ * Compacts the disk, optionally moving at most a given number of
+ * blocks so that it can be run a little at a time.
+ */
+int cmd_defrag(char *argv[]) {
+    long budget = -1;
+    long sectorsBefore = numSectors();
+    long moved, misplaced;
+
+    if (argv[1]) {
+        budget = atol(argv[1]);
+
+        if (budget <= 0) {
+            printf("defrag: block budget must be positive\n");
+            return 1;
+        }
+    }
+
+    moved = defragDisk(budget, &misplaced);
+
+    printf("Moved %ld blocks; %ld sectors before, %ld after\n",
+        moved, sectorsBefore, numSectors());
+
+    if (misplaced < 0) {
+        printf("defrag: cannot continue: no free block to move through\n");
+        return 1;
+    } else if (misplaced > 0)
+        printf("Up to %ld blocks still out of place; run defrag again to continue\n", misplaced);
+    else
+        printf("Disk is fully compacted\n");
+
+    return 0;
+}
+
+/* Prints how much each node and list pool has handed out */
+int cmd_prmem(char *argv[]) {
+    struct poolstats stats;
+    int i;
+
+    (void) argv;
+
+    /* Each item taken used to be a malloc of its own */
+    printf("%-20s %12s %12s %8s\n", "Pool", "Taken", "In use", "Mallocs");
+
+    for (i = 0; !poolStats(i, &stats); i++)
+        printf("%-20s %12ld %12ld %8ld\n", stats.name, stats.taken, stats.live, stats.mallocs);
+
+    return 0;
+}
 
-            /* Free the array */
-            free(blks);
+/**
+ * Allocates every block still awaiting delayed allocation.
+ */
+int cmd_sync(char *argv[]) {
+    long n;
 
+    (void) argv;
 
+    n = syncFilesystem();
+    printf("Allocated %ld delayed blocks\n", n);
+
+    return 0;
+}
+
+/* Prints the path of the file with a block map in each tree that has it */
+static void printMapHolders(BlockMap map) {
+    DirTree node;
+    long i;
+
+    if ((node = findBlockMap(getRootNode(), map))) {
+        printf(" ");
+        printTreePath(getRootNode(), node);
+    }
+
+    for (i = 0; i < numSnapshots(); i++) {
+        if ((node = findBlockMap(getSnapshotAt(i), map))) {
+            printf(" ");
+            printTreePath(getSnapshotAt(i), node);
         }
+    }
+}
 
+int cmd_blkowner(char *argv[]) {
+    char label[48];
+    long lo, hi;
+
+    if (!argv[1]) {
+        printf("blkowner: missing operand\n");
+        return 1;
+    }
+
+    /* A single block, or an inclusive range of them */
+    lo = atol(argv[1]);
+    hi = argv[2] ? atol(argv[2]) + 1 : lo + 1;
+
+    if (lo < 0 || lo >= numBlocks() || hi <= lo || hi > numBlocks()) {
+        printf("blkowner: invalid block range (the disk has %ld blocks)\n", numBlocks());
+        return 1;
+    }
+
+    while (lo < hi) {
+        /* Each step covers one run with the same holders and the same
+           number of references, found a run at a time */
+        long offset, i;
+        BlockMap map;
+        long end = ownerRunEnd(lo, hi);
+        long split = refRunEnd(lo, hi);
+
+        if (split < end)
+            end = split;
+
+        /* Block range, then who holds it */
+        if (end - lo == 1)
+            sprintf(label, "%ld", lo);
+        else
+            sprintf(label, "%ld-%ld", lo, end - 1);
+        printf("%-15s ", label);
+
+        /* Shared blocks are held by several block maps, and a map by
+           every tree that shares its file */
+        for (i = 0; (map = getBlockHolder(lo, i, &offset)); i++) {
+            if (i)
+                printf("; ");
+
+            if (end - lo == 1)
+                printf("block %ld of", offset);
+            else
+                printf("blocks %ld-%ld of", offset, offset + end - lo - 1);
+            printMapHolders(map);
+        }
+
+        if (i)
+            printf("\n");
+        else if (blockRefs(lo))
+            printf("allocated, no recorded owner\n");
+        else
+            printf("free\n");
+
+        lo = end;
     }
-    
-    /* Dispose of the list */
-    free(bfs_list);
 
     return 0;
+}
+
+int cmd_snapshot(char *argv[]) {
+    long i;
+    int err;
+
+    if (!argv[1]) {
+        /* List the snapshots */
+        for (i = 0; i < numSnapshots(); i++)
+            printTreeNode(getSnapshotAt(i), NULL, 1);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "-d")) {
+        if (!argv[2]) {
+            printf("snapshot: missing operand\n");
+            return 1;
+        }
+
+        err = dropSnapshot(argv[2]);
+
+        if (err == 1)
+            printf("snapshot: cannot delete '%s': No such snapshot\n", argv[2]);
+        else if (err == 2)
+            printf("snapshot: cannot delete '%s': Directory currently in use\n", argv[2]);
+
+        return err ? 1 : 0;
+    }
+
+    err = takeSnapshot(argv[1]);
+
+    if (err == 1)
+        printf("snapshot: cannot create '%s': Already exists\n", argv[1]);
+    else if (err)
+        printf("snapshot: cannot create '%s': Invalid name\n", argv[1]);
+    else
+        printf("Saved snapshot @%s\n", argv[1]);
 
+    return err ? 1 : 0;
 }
 
+int cmd_clone(char *argv[]) {
+    char **path;
+    DirTree src, dir, dst;
+    char *name;
+    int k;
 
+    if (!argv[1] || !argv[2]) {
+        printf("clone: missing operand\n");
+        return 1;
+    }
+
+    path = str_to_vec(argv[1], '/');
+    src = getRelTree(getWorkDirNode(), path);
+    free_str_vec(path);
+
+    if (!src || !isTreeFile(src)) {
+        printf("clone: cannot clone '%s': No such file\n", argv[1]);
+        return 1;
+    }
 
+    path = str_to_vec(argv[2], '/');
 
+    if (getRelTree(getWorkDirNode(), path)) {
+        printf("clone: cannot create '%s': Already exists\n", argv[2]);
+        free_str_vec(path);
+        return 1;
+    }
+
+    /* Separate the new name from its directory */
+    for (k = 0; path[k]; k++);
+    name = path[k-1];
+    path[k-1] = NULL;
+    dir = getRelTree(getWorkDirNode(), path);
+    path[k-1] = name;
+
+    if (!dir || isTreeFile(dir)) {
+        printf("clone: cannot create '%s': No such directory\n", argv[2]);
+        free_str_vec(path);
+        return 1;
+    } else if (isSnapshotName(name)) {
+        printf("clone: cannot create '%s': Names starting with '@' are snapshots\n", argv[2]);
+        free_str_vec(path);
+        return 1;
+    } else if (isReadOnly(path)) {
+        printf("clone: cannot create '%s': Read-only snapshot\n", argv[2]);
+        free_str_vec(path);
+        return 1;
+    }
+
+    dir = writableTree(dir);
+    addFileToTree(dir, &path[k-1]);
+    dst = findDirChild(dir, name);
+    free_str_vec(path);
+
+    cloneFile(src, dst);
+    updateTimestamp(dir);
+
+    printf("Cloned %ld blocks (no new blocks allocated)\n", getTreeBlockCount(dst));
+
+    return 0;
+}
@@ -7,11 +7,14 @@
  * James Romph
  */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef int (*SimCmd)(char**);
 
 char** str_to_vec(char*, char);
 void free_str_vec(char**);
-void mergesort_longs(long*, int, int);
 
 /**
  * Executes a command in the file system.
@@ -36,9 +39,28 @@ int cmd_create(char *argv[]);
  */
 int cmd_append(char *argv[]);
 int cmd_remove(char *argv[]);
+int cmd_truncate(char *argv[]);
+
+/**
+ * Write into a range of a file, allocating any holes in it, or copy
+ * a range between a file and the host through the disk image.
+ */
+int cmd_write(char *argv[]);
+int cmd_read(char *argv[]);
+
+/**
+ * Reserve blocks for a file to grow into, or release the unused ones.
+ */
+int cmd_prealloc(char *argv[]);
+int cmd_trim(char *argv[]);
 
 int cmd_delete(char *argv[]);
 
+/**
+ * Copy a file by sharing its blocks.
+ */
+int cmd_clone(char *argv[]);
+
 /**
  * Terminate program.
  */
@@ -57,4 +79,28 @@ int cmd_prdisk(char *argv[]);
 
 int cmd_defrag(char *argv[]);
 
+/**
+ * Print which file holds each block in a range.
+ */
+int cmd_blkowner(char *argv[]);
+
+/**
+ * Print the allocation counts of the memory pools.
+ */
+int cmd_prmem(char *argv[]);
+
+/**
+ * Allocate blocks deferred by delayed allocation.
+ */
+int cmd_sync(char *argv[]);
+
+/**
+ * Save, list or delete read-only snapshots of the file tree.
+ */
+int cmd_snapshot(char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -1,99 +1,762 @@
 #include "linkedlist.h"
 #include "dirtree.h"
+#include "runvec.h"
 #include "cmds.h"
+#include "pool.h"
+#include "extenttree.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+
+/**
+ * The identity of a node: its name and the identity of its parent
+ * directory, or no parent for a root. A snapshot shares identities
+ * with the live tree, so a node seen in one tree can be found again
+ * in another by following its names down from that tree's root.
+ */
+struct treename {
+    char *name;
+    struct treename *parent;
+
+    /* Nodes, block maps and child identities holding this one */
+    long refs;
+}; typedef struct treename* TreeName;
 
 struct filedata {
-    long size;
-    LList blocks;
+    /* The file's blocks as runs, in logical order */
+    Extent *extents;
+    long num_extents;
+    long cap_extents;
+
+    /* Total number of blocks across the extents */
+    long num_blocks;
+
+    /* Blocks reserved for the file but not yet allocated, and the
+       file's item in the list of files that have some */
+    long delayed;
+    LLnode pending;
+
+    /* The number of nodes sharing the map, and the file's identity */
+    long refs;
+    TreeName id;
 }; typedef struct filedata* FileData;
 
 struct dirdata {
-    LList files;
-}; typedef struct filedata* DirData;
+    /* The children, linked through their sibling pointers in name order */
+    DirTree first_child;
+    long num_children;
 
+    /* The number of nodes sharing the children */
+    long refs;
+}; typedef struct dirdata* DirData;
+
+/**
+ * A node of a tree. A node's data may be shared with nodes of other
+ * trees (see shareDirTree); it is copied the first time one of them
+ * needs to change it (see ownTreePath). A directory's child nodes
+ * belong to its data, so they are shared along with it.
+ */
 struct dirtree {
     /* Is the node a file or directory */
     int is_file;
 
-    /* The name of the node */
-    char *name;
+    /* The name of the node, and of its parents */
+    TreeName id;
+
+    /* The neighbouring children of the parent directory */
+    DirTree prev_sibling;
+    DirTree next_sibling;
 
-    /* The parent directory */
-    DirTree parent_dir;
+    /* The node's slot in the inode table */
+    long ino;
 
     /* Timestamp of when the node was last changed. */
     time_t timestamp;
 
     union {
-        struct filedata file_dta;
-        struct dirdata  dir_dta;
+        FileData file_dta;
+        DirData  dir_dta;
     } nodedata;
 };
 
+/**
+ * The reverse block map: which block maps hold each block, and where
+ * in each. It is an extent tree over the disk, split wherever the
+ * set of holders changes, whose values are lists of holders giving
+ * the logical block each holder maps the extent's first block to.
+ * Blocks no map holds have no extent. Touching extents that continue
+ * one another are merged, so a map costs about one extent per run.
+ * It is kept up to date by every function that changes a block map.
+ */
+struct blockowner {
+    FileData file;
+    long offset;
+    struct blockowner *next;
+};
+
+ExtTree BLOCK_OWNERS = NULL;
+long OWNED_BLOCKS = 0;
+
+/* Holder records come from a pool */
+Pool OWNER_RECORDS = NULL;
+
+/**
+ * Tree nodes, identities, block maps and directories' data come from
+ * pools. Names and extent arrays come from the heap, or in arena mode
+ * from TREE_DATA, which is only ever released as a whole.
+ */
+Pool TREE_NODES = NULL;
+Pool TREE_NAMES = NULL;
+Pool FILE_MAPS = NULL;
+Pool DIR_DATA = NULL;
+Arena TREE_DATA = NULL;
+
+/**
+ * The inode table. Every node has an inode number, and the fields
+ * that are read without needing the rest of the node live here, one
+ * array per field: the node itself, the inode of its parent and the
+ * size of a file. A node shared by several trees keeps one inode, held
+ * through the reference count of the directory data listing it, so
+ * snapshots cost no inodes until a node is copied.
+ *
+ * A parent is the node whose data lists the child. When that node lets
+ * go of data other nodes still share (see ownTreeData and dropNode),
+ * the child's parent is forgotten and found by name from the root
+ * instead; see getTreeParent. Freed inode numbers are reused first.
+ */
+struct inodetable {
+    long count;
+    long cap;
+
+    DirTree *node;
+    long *parent;
+    long *size;
+
+    /* Stack of free inode numbers below count */
+    long *free;
+    long num_free;
+};
+
+struct inodetable INODES = {0, 0, NULL, NULL, NULL, NULL, 0};
+
+static void growInodes() {
+    long cap = INODES.cap ? 2 * INODES.cap : 64;
+
+    INODES.node = (DirTree*) realloc(INODES.node, cap * sizeof(DirTree));
+    INODES.parent = (long*) realloc(INODES.parent, cap * sizeof(long));
+    INODES.size = (long*) realloc(INODES.size, cap * sizeof(long));
+    INODES.free = (long*) realloc(INODES.free, cap * sizeof(long));
+    INODES.cap = cap;
+}
+
+/* Gives a node an inode of its own, with no parent and no size */
+static long takeInode(DirTree node) {
+    long ino;
+
+    if (INODES.num_free)
+        ino = INODES.free[--INODES.num_free];
+    else {
+        if (INODES.count == INODES.cap)
+            growInodes();
+        ino = INODES.count++;
+    }
+
+    INODES.node[ino] = node;
+    INODES.parent[ino] = -1;
+    INODES.size[ino] = 0;
+
+    return ino;
+}
+
+static void giveInode(long ino) {
+    INODES.node[ino] = NULL;
+    INODES.parent[ino] = -1;
+
+    INODES.free[INODES.num_free++] = ino;
+}
+
+/**
+ * Forgets node as the parent of the children of dir, which node is
+ * letting go of while other nodes still share it.
+ */
+static void forgetParent(DirData dir, DirTree node) {
+    DirTree child;
+
+    for (child = dir->first_child; child; child = child->next_sibling) {
+        if (INODES.parent[child->ino] == node->ino)
+            INODES.parent[child->ino] = -1;
+    }
+}
+
+/* Runs collected from block maps as they are disposed of */
+static void* takeTreeData(long bytes) {
+    return TREE_DATA ? takeFromArena(TREE_DATA, bytes) : malloc(bytes);
+}
+
+static void giveTreeData(void *data) {
+    if (!TREE_DATA)
+        free(data);
+}
+
+/* Resizes data taken with takeTreeData from old to bytes */
+static void* growTreeData(void *data, long old, long bytes) {
+    void *grown;
+
+    if (!TREE_DATA)
+        return realloc(data, bytes);
+
+    /* The old copy stays in the arena until it is reset */
+    grown = takeFromArena(TREE_DATA, bytes);
+    if (old)
+        memcpy(grown, data, old);
+
+    return grown;
+}
+
+void useTreeArena(int on) {
+    if (on && !TREE_DATA)
+        TREE_DATA = makeArena("tree data (bytes)");
+    else if (!on && TREE_DATA) {
+        flushArena(TREE_DATA);
+        TREE_DATA = NULL;
+    }
+}
+
+void resetDirTrees() {
+    if (TREE_NODES) {
+        resetPool(TREE_NODES);
+        resetPool(TREE_NAMES);
+        resetPool(FILE_MAPS);
+        resetPool(DIR_DATA);
+    }
+    if (TREE_DATA)
+        resetArena(TREE_DATA);
+
+    /* Every inode is free again */
+    INODES.count = 0;
+    INODES.num_free = 0;
+}
+
+static void reserveExtents(FileData file, long n);
+
+static struct blockowner* makeOwner(FileData file, long offset, struct blockowner *next) {
+    struct blockowner *owner = (struct blockowner*) takeFromPool(OWNER_RECORDS);
+
+    owner->file = file;
+    owner->offset = offset;
+    owner->next = next;
+
+    return owner;
+}
+
+static void freeOwners(struct blockowner *list) {
+    while (list) {
+        struct blockowner *next = list->next;
+
+        giveToPool(OWNER_RECORDS, list);
+        list = next;
+    }
+}
+
+/* Copies a list of holders, each offset moved on by shift blocks */
+static struct blockowner* copyOwners(struct blockowner *list, long shift) {
+    struct blockowner *copy = NULL, **tail = &copy;
+
+    for (; list; list = list->next) {
+        *tail = makeOwner(list->file, list->offset + shift, NULL);
+        tail = &(*tail)->next;
+    }
+
+    return copy;
+}
+
+/* Makes sure that no owner extent straddles blk */
+static void splitOwners(long blk) {
+    ExtNode ext = findInET(BLOCK_OWNERS, blk);
+
+    if (ext && extStartET(ext) < blk) {
+        long start = extStartET(ext);
+        long end = extEndET(ext);
+
+        setExtBoundsET(ext, start, blk);
+        insertET(BLOCK_OWNERS, blk, end, copyOwners((struct blockowner*) extValET(ext), blk - start));
+    }
+}
+
+/**
+ * Whether owner extent b carries on from a: they touch, and the same
+ * maps hold both, in the same order, at continuing offsets.
+ */
+static int continuesOwners(ExtNode a, ExtNode b) {
+    struct blockowner *x = (struct blockowner*) extValET(a);
+    struct blockowner *y = (struct blockowner*) extValET(b);
+    long len = extEndET(a) - extStartET(a);
+
+    if (extEndET(a) != extStartET(b))
+        return 0;
+
+    for (; x && y; x = x->next, y = y->next) {
+        if (x->file != y->file || x->offset + len != y->offset)
+            return 0;
+    }
+
+    return !x && !y;
+}
+
+/* Rejoins the owner extents around [lo, hi) that continue one another */
+static void mergeOwners(long lo, long hi) {
+    ExtNode ext = floorET(BLOCK_OWNERS, lo > 0 ? lo - 1 : 0);
+
+    if (!ext)
+        ext = firstET(BLOCK_OWNERS);
+
+    while (ext && extStartET(ext) <= hi) {
+        ExtNode next = nextET(ext);
+
+        if (next && continuesOwners(ext, next)) {
+            long end = extEndET(next);
+
+            freeOwners((struct blockowner*) removeET(BLOCK_OWNERS, next));
+            setExtBoundsET(ext, extStartET(ext), end);
+        } else
+            ext = next;
+    }
+}
+
+/* Clips [*start, *end) to the blocks the owner map covers, keeping *offset in step */
+static int clipOwned(long *start, long *end, long *offset) {
+    if (*start < 0) {
+        *offset -= *start;
+        *start = 0;
+    }
+    if (*end > OWNED_BLOCKS)
+        *end = OWNED_BLOCKS;
+
+    return *start < *end;
+}
+
+/* Records that a map holds [start, start+len), from logical block offset on */
+static void setBlockOwners(FileData file, long start, long len, long offset) {
+    long end = start + len;
+    long p;
+    ExtNode ext;
+
+    if (!clipOwned(&start, &end, &offset))
+        return;
+
+    splitOwners(start);
+    splitOwners(end);
+
+    for (p = start, ext = ceilET(BLOCK_OWNERS, start); p < end; ) {
+        if (ext && extStartET(ext) < end) {
+            /* Blocks before the extent had no holder */
+            if (p < extStartET(ext))
+                insertET(BLOCK_OWNERS, p, extStartET(ext), makeOwner(file, offset + p - start, NULL));
+
+            setExtValET(ext, makeOwner(file, offset + extStartET(ext) - start,
+                                       (struct blockowner*) extValET(ext)));
+            p = extEndET(ext);
+            ext = nextET(ext);
+        } else {
+            insertET(BLOCK_OWNERS, p, end, makeOwner(file, offset + p - start, NULL));
+            p = end;
+        }
+    }
+
+    mergeOwners(start, end);
+}
+
+/* Forgets that a map holds [start, start+len); other holders stay */
+static void clearBlockOwners(FileData file, long start, long len) {
+    long end = start + len;
+    long offset = 0;
+    ExtNode ext;
+
+    if (!clipOwned(&start, &end, &offset))
+        return;
+
+    splitOwners(start);
+    splitOwners(end);
+
+    for (ext = ceilET(BLOCK_OWNERS, start); ext && extStartET(ext) < end; ) {
+        ExtNode next = nextET(ext);
+        struct blockowner *list = (struct blockowner*) extValET(ext);
+        struct blockowner *owner, *prev = NULL;
+
+        for (owner = list; owner && owner->file != file; owner = owner->next)
+            prev = owner;
+
+        if (owner) {
+            if (prev)
+                prev->next = owner->next;
+            else
+                list = owner->next;
+            giveToPool(OWNER_RECORDS, owner);
+        }
+
+        if (list)
+            setExtValET(ext, list);
+        else
+            removeET(BLOCK_OWNERS, ext);
+
+        ext = next;
+    }
+
+    mergeOwners(start, end);
+}
+
+/**
+ * The logical block at which a map holds a block, read from the
+ * owner map, or -1 if it does not hold it.
+ */
+static long ownerOffset(FileData file, long blk) {
+    ExtNode ext = BLOCK_OWNERS ? findInET(BLOCK_OWNERS, blk) : NULL;
+    struct blockowner *owner;
+
+    for (owner = ext ? (struct blockowner*) extValET(ext) : NULL; owner; owner = owner->next) {
+        if (owner->file == file)
+            return owner->offset + blk - extStartET(ext);
+    }
+
+    return -1;
+}
+
+static TreeName makeTreeName(char *name) {
+    TreeName id = (TreeName) takeFromPool(TREE_NAMES);
+
+    id->name = (char*) takeTreeData((1 + strlen(name)) * sizeof(char));
+    strcpy(id->name, name);
+
+    id->parent = NULL;
+    id->refs = 1;
+
+    return id;
+}
+
+static TreeName holdTreeName(TreeName id) {
+    if (id)
+        id->refs++;
+
+    return id;
+}
+
+/* Drops a hold on an identity, and on its parents as they go */
+static void dropTreeName(TreeName id) {
+    while (id && !--id->refs) {
+        TreeName parent = id->parent;
+
+        giveTreeData(id->name);
+        giveToPool(TREE_NAMES, id);
+        id = parent;
+    }
+}
+
+static FileData makeFileData(TreeName id) {
+    FileData file = (FileData) takeFromPool(FILE_MAPS);
+
+    /* Starts with no blocks */
+    file->delayed = 0;
+    file->pending = NULL;
+    file->extents = NULL;
+    file->num_extents = 0;
+    file->cap_extents = 0;
+    file->num_blocks = 0;
+
+    file->refs = 1;
+    file->id = holdTreeName(id);
+
+    return file;
+}
+
+static DirData makeDirData() {
+    DirData dir = (DirData) takeFromPool(DIR_DATA);
+
+    dir->first_child = NULL;
+    dir->num_children = 0;
+    dir->refs = 1;
+
+    return dir;
+}
+
+/**
+ * Gives a map with no blocks the blocks of another, and records it
+ * as one of their holders.
+ */
+static void copyExtents(FileData from, FileData to) {
+    long i;
+
+    reserveExtents(to, from->num_extents);
+    if (from->num_extents)
+        memcpy(to->extents, from->extents, from->num_extents * sizeof(Extent));
+    to->num_extents = from->num_extents;
+    to->num_blocks = from->num_blocks;
+
+    for (i = 0; i < to->num_extents; i++)
+        setBlockOwners(to, to->extents[i].start, to->extents[i].len, to->extents[i].offset);
+}
 
 /**
  * Creates a directory node. Duplicates the name w/ strdup().
  */
 DirTree makeDirTree(char *name, int is_file) {
-    DirTree node = (DirTree) malloc(sizeof(struct dirtree));
+    DirTree node;
 
-    node->name = (char*) malloc((1 + strlen(name)) * sizeof(char));
-    strcpy(node->name, name);
+    if (!TREE_NODES) {
+        TREE_NODES = makePool("tree nodes", sizeof(struct dirtree));
+        TREE_NAMES = makePool("tree names", sizeof(struct treename));
+        FILE_MAPS = makePool("file maps", sizeof(struct filedata));
+        DIR_DATA = makePool("directories", sizeof(struct dirdata));
+    }
+    node = (DirTree) takeFromPool(TREE_NODES);
+
+    node->id = makeTreeName(name);
+    node->ino = takeInode(node);
 
     node->is_file = is_file;
+    node->prev_sibling = NULL;
+    node->next_sibling = NULL;
 
-    if (is_file) {
-        /* Starts as 0 byte file */
-        node->nodedata.file_dta.size = 0;
-        
-        /* Create block list */
-        node->nodedata.file_dta.blocks = makeLL();
-    } else {
-        node->nodedata.dir_dta.files = makeLL();
+    if (is_file)
+        node->nodedata.file_dta = makeFileData(node->id);
+    else
+        node->nodedata.dir_dta = makeDirData();
 
-        node->parent_dir = node;
-    }
-    
     /* Update the timestamp */
     updateTimestamp(node);
 
     return node;
 }
 
+static void dropNode(DirTree node, RunVec *runs);
+
+/**
+ * Drops a node's hold on a block map. The last one to go clears the
+ * map from the owner map and hands its runs to runs, if not NULL.
+ */
+static void dropFileData(FileData file, RunVec *runs) {
+    long i;
+
+    if (--file->refs)
+        return;
+
+    for (i = 0; i < file->num_extents; i++) {
+        clearBlockOwners(file, file->extents[i].start, file->extents[i].len);
+
+        if (runs)
+            pushRunVec(runs, file->extents[i].start, file->extents[i].len, file->extents[i].offset);
+    }
+
+    giveTreeData(file->extents);
+    dropTreeName(file->id);
+    giveToPool(FILE_MAPS, file);
+}
+
+/* Drops a node's hold on a directory's children */
+static void dropDirData(DirData dir, RunVec *runs) {
+    if (--dir->refs)
+        return;
+
+    while (dir->first_child) {
+        DirTree child = dir->first_child;
+
+        dir->first_child = child->next_sibling;
+        dropNode(child, runs);
+    }
+
+    giveToPool(DIR_DATA, dir);
+}
+
+/* Disposes of a node, and of whatever it held alone */
+static void dropNode(DirTree node, RunVec *runs) {
+    if (node->is_file)
+        dropFileData(node->nodedata.file_dta, runs);
+    else {
+        if (node->nodedata.dir_dta->refs > 1)
+            forgetParent(node->nodedata.dir_dta, node);
+        dropDirData(node->nodedata.dir_dta, runs);
+    }
+
+    giveInode(node->ino);
+    dropTreeName(node->id);
+    node->is_file = 0;
+    giveToPool(TREE_NODES, node);
+}
+
 void flushDirTree(DirTree tree) {
-    
-    if (tree->is_file) {
+    dropNode(tree, NULL);
+}
 
-        /* Remove and free every value from the block allocation. */
-        while (!isEmptyLL(tree->nodedata.file_dta.blocks))
-            free(remFromLL(tree->nodedata.file_dta.blocks, 0));
-        
-        /* Then, free the list */
-        free(tree->nodedata.file_dta.blocks);
-        tree->nodedata.file_dta.blocks = NULL;
+long dropDirTree(DirTree tree, RunVec *runs) {
+    size_t before = runs->len;
+
+    dropNode(tree, runs);
+
+    return runs->len - before;
+}
+
+/**
+ * Links child into dir's children right after prev, or first if prev
+ * is NULL.
+ */
+static void linkChild(DirTree dir, DirTree prev, DirTree child) {
+    DirTree next = prev ? prev->next_sibling : dir->nodedata.dir_dta->first_child;
+
+    child->prev_sibling = prev;
+    child->next_sibling = next;
+    INODES.parent[child->ino] = dir->ino;
+
+    if (prev)
+        prev->next_sibling = child;
+    else
+        dir->nodedata.dir_dta->first_child = child;
+    if (next)
+        next->prev_sibling = child;
+
+    dir->nodedata.dir_dta->num_children++;
+}
+
+/**
+ * Unlinks child from dir's children.
+ */
+static void unlinkChild(DirTree dir, DirTree child) {
+    if (child->prev_sibling)
+        child->prev_sibling->next_sibling = child->next_sibling;
+    else
+        dir->nodedata.dir_dta->first_child = child->next_sibling;
+    if (child->next_sibling)
+        child->next_sibling->prev_sibling = child->prev_sibling;
+
+    child->prev_sibling = NULL;
+    child->next_sibling = NULL;
+    INODES.parent[child->ino] = -1;
+
+    dir->nodedata.dir_dta->num_children--;
+}
+
+/**
+ * A node with the same identity, size and timestamp that shares
+ * node's data. It has an inode of its own, and no parent until it is
+ * linked.
+ */
+static DirTree copyNode(DirTree node) {
+    DirTree copy = (DirTree) takeFromPool(TREE_NODES);
+
+    copy->is_file = node->is_file;
+    copy->id = holdTreeName(node->id);
+    copy->ino = takeInode(copy);
+    INODES.size[copy->ino] = INODES.size[node->ino];
+    copy->prev_sibling = NULL;
+    copy->next_sibling = NULL;
+    copy->timestamp = node->timestamp;
+    copy->nodedata = node->nodedata;
+
+    if (copy->is_file)
+        copy->nodedata.file_dta->refs++;
+    else
+        copy->nodedata.dir_dta->refs++;
+
+    return copy;
+}
+
+DirTree shareDirTree(DirTree tree, char *name) {
+    DirTree copy;
+
+    if (!tree)
+        return NULL;
+
+    copy = copyNode(tree);
+
+    dropTreeName(copy->id);
+    copy->id = makeTreeName(name);
+
+    return copy;
+}
+
+/**
+ * Gives a node data of its own if it shares any: a copy of the block
+ * map for a file, or for a directory new nodes for its children that
+ * share their data in turn.
+ *
+ * return - Whether anything was copied.
+ */
+static int ownTreeData(DirTree node) {
+    if (node->is_file) {
+        FileData file = node->nodedata.file_dta;
+
+        if (file->refs < 2)
+            return 0;
+
+        file->refs--;
+        node->nodedata.file_dta = makeFileData(file->id);
+        node->nodedata.file_dta->delayed = file->delayed;
+        node->nodedata.file_dta->pending = file->pending;
+        copyExtents(file, node->nodedata.file_dta);
     } else {
-        /* Flush every subtree */
-        while (!isEmptyLL(tree->nodedata.dir_dta.files)) {
-            DirTree subtree = (DirTree) remFromLL(tree->nodedata.dir_dta.files, 0);
-            flushDirTree(subtree);
-        }
+        DirData dir = node->nodedata.dir_dta;
+        DirTree child, last = NULL;
 
-        /* Free and zero */
-        free(tree->nodedata.dir_dta.files);
-        tree->nodedata.dir_dta.files = NULL;
+        if (dir->refs < 2)
+            return 0;
 
-        tree->parent_dir = NULL;
+        dir->refs--;
+        forgetParent(dir, node);
+        node->nodedata.dir_dta = makeDirData();
 
+        /* Children keep their order */
+        for (child = dir->first_child; child; child = child->next_sibling) {
+            DirTree copy = copyNode(child);
+
+            linkChild(node, last, copy);
+            last = copy;
+        }
     }
-    
-    /* Final frees */
-    free(tree->name);
-    tree->is_file = 0;
-    free(tree);
+
+    return 1;
+}
+
+/* The node of a tree with the given identity, or NULL */
+static DirTree findByName(DirTree root, TreeName id) {
+    if (!id->parent)
+        return root;
+
+    return findDirChild(findByName(root, id->parent), id->name);
+}
+
+/* Like findByName, but gives every node on the way data of its own */
+static DirTree ownByName(DirTree root, TreeName id, int *copied) {
+    DirTree node = root;
+
+    if (id->parent)
+        node = findDirChild(ownByName(root, id->parent, copied), id->name);
+
+    if (node && ownTreeData(node))
+        *copied = 1;
+
+    return node;
+}
+
+DirTree findTreeNode(DirTree root, DirTree tree) {
+    return root && tree ? findByName(root, tree->id) : NULL;
+}
+
+DirTree ownTreePath(DirTree root, DirTree tree, int *copied) {
+    *copied = 0;
+
+    return root && tree ? ownByName(root, tree->id, copied) : NULL;
+}
+
+int copyFileBlocks(DirTree src, DirTree dst) {
+    if (!src || !dst || !(src->is_file) || !(dst->is_file) || src == dst)
+        return 1;
+
+    if (dst->nodedata.file_dta->num_blocks || src->nodedata.file_dta == dst->nodedata.file_dta)
+        return 1;
+
+    copyExtents(src->nodedata.file_dta, dst->nodedata.file_dta);
+
+    return 0;
 }
 
 /**
@@ -103,72 +766,186 @@ void flushDirTree(DirTree tree) {
  * return - The requested node, or NULL if it doesn't exist.
  */
 DirTree getDirSubtree(DirTree tree, char *path[]) {
-    LLiter iter;
+    DirTree child;
 
     if (!path || !path[0])
         return tree; /* Found the file */
 
-    else if (tree->is_file)
+    else if (!tree || tree->is_file)
         return NULL; /* Files do not have subdirectories. */
 
     else if (!path[0][0] || !strcmp(path[0], "."))
         return getDirSubtree(tree, &path[1]); /* Stay in current dir */
 
-    else if (!strcmp(path[0], ".."))
-        return getDirSubtree(tree->parent_dir, &path[1]); /* Go back one directory */
-    
     /* Search the subfiles for the next recursive step */
-    iter = makeLLiter(tree->nodedata.dir_dta.files);
-    while (iterHasNextLL(iter)) {
-        
-        /* Get the next item from the iterator */
-        DirTree child = (DirTree) iterNextLL(iter);
+    child = findDirChild(tree, path[0]);
+
+    return child ? getDirSubtree(child, &path[1]) : NULL;
+}
+
+void viewDirChildren(DirTree dir, ChildView *view) {
+    view->next = dir && !dir->is_file ? dir->nodedata.dir_dta->first_child : NULL;
+}
+
+DirTree nextDirChild(ChildView *view) {
+    DirTree child = view->next;
+
+    /* Step past it first, so that the caller may unlink it */
+    if (child)
+        view->next = child->next_sibling;
+
+    return child;
+}
+
+long numDirChildren(DirTree dir) {
+    return dir && !dir->is_file ? dir->nodedata.dir_dta->num_children : 0;
+}
+
+/**
+ * The queue of a breadth-first walk: a ring buffer of the nodes
+ * waiting to be visited, doubling when full.
+ */
+struct treequeue {
+    DirTree *items;
+    long head;
+    long len;
+    long cap;
+};
+
+static void pushTreeQueue(struct treequeue *q, DirTree node) {
+    if (q->len == q->cap) {
+        long cap = q->cap ? 2 * q->cap : 64;
+        DirTree *items = (DirTree*) malloc(cap * sizeof(DirTree));
+        long i;
+
+        /* Unwrap into the new buffer */
+        for (i = 0; i < q->len; i++)
+            items[i] = q->items[(q->head + i) % q->cap];
+
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+
+    q->items[(q->head + q->len++) % q->cap] = node;
+}
+
+static DirTree popTreeQueue(struct treequeue *q) {
+    DirTree node = q->items[q->head];
+
+    q->head = (q->head + 1) % q->cap;
+    q->len--;
+
+    return node;
+}
+
+int walkDirTree(DirTree root, TreeVisitor visit, void *arg) {
+    struct treequeue q = {NULL, 0, 0, 0};
+    int stop = 0;
+
+    if (root)
+        pushTreeQueue(&q, root);
+
+    while (q.len) {
+        DirTree node = popTreeQueue(&q);
+
+        if ((stop = visit(node, arg)))
+            break;
+
+        if (!node->is_file) {
+            DirTree child;
+
+            for (child = node->nodedata.dir_dta->first_child; child; child = child->next_sibling)
+                pushTreeQueue(&q, child);
+        }
+    }
+
+    free(q.items);
+
+    return stop;
+}
 
-        if (!strcmp(path[0], child->name)) {
+/**
+ * The last child of a directory whose name sorts before the given
+ * name, or NULL if there is none. Children are kept in name order.
+ */
+static DirTree childBefore(DirTree dir, char *name) {
+    DirTree child, prev = NULL;
 
-            disposeIterLL(iter);
-        
-            /* The child is should be searched through. */
-            return getDirSubtree(child, &path[1]);
-        }
+    for (child = dir->nodedata.dir_dta->first_child; child; child = child->next_sibling) {
+        if (strcmp(child->id->name, name) >= 0)
+            break;
+        prev = child;
     }
 
-    disposeIterLL(iter);
+    return prev;
+}
+
+DirTree findDirChild(DirTree dir, char *name) {
+    DirTree child;
+
+    if (!dir || dir->is_file || !name)
+        return NULL;
+
+    /* The match, if any, follows the last child sorting before it */
+    child = childBefore(dir, name);
+    child = child ? child->next_sibling : dir->nodedata.dir_dta->first_child;
 
-    return NULL;
+    return child && !strcmp(child->id->name, name) ? child : NULL;
 }
 
-DirTree getTreeParent(DirTree tree) {
-    if (tree)
-        return tree->parent_dir ? tree->parent_dir : tree;
-    else
+DirTree getTreeParent(DirTree root, DirTree tree) {
+    long parent;
+
+    if (!tree)
         return NULL;
+    else if (!tree->id->parent)
+        return root; /* The root is its own parent */
+
+    /* A parent that is the only node listing the child is in every
+       tree the child is in */
+    parent = INODES.parent[tree->ino];
+    if (parent >= 0 && INODES.node[parent]->nodedata.dir_dta->refs == 1)
+        return INODES.node[parent];
+
+    return findByName(root, tree->id->parent);
 }
 
-int addNodeToTree(DirTree tree, char *path[], int is_file) {
-    int i;
-    DirTree tgtDir;
+/**
+ * Splits a path into the path of its directory, which is malloc'd
+ * and must be freed, and its last name.
+ */
+static char** parentOfPath(char *path[], char **name) {
     char **subpath;
-    char *filename;
-    
-    /* Error check */
-    if (!path || !path[0])
-        return 3;
+    int i = 0;
 
-    /* Make memory space for subpath */
-    i = 0;
     while (path[i]) i++;
     subpath = (char**) malloc(i * sizeof(char*));
 
     /* Get the filename */
-    filename = path[--i];
-    
+    *name = path[--i];
+
     /* Build the subpath */
     subpath[i--] = NULL;
     for (; i >= 0; i--)
         subpath[i] = path[i];
+
+    return subpath;
+}
+
+
+int addNodeToTree(DirTree tree, char *path[], int is_file) {
+    DirTree tgtDir;
+    char **subpath;
+    char *filename;
     
+    /* Error check */
+    if (!path || !path[0])
+        return 3;
+
     /* Get the destination */
+    subpath = parentOfPath(path, &filename);
     tgtDir = getDirSubtree(tree, subpath);
     free(subpath);
 
@@ -183,10 +960,10 @@ int addNodeToTree(DirTree tree, char *path[], int is_file) {
         DirTree file = makeDirTree(filename, is_file);
 
         /* Set the parent directory */
-        file->parent_dir = tgtDir;
+        file->id->parent = holdTreeName(tgtDir->id);
 
-        /* Add to the file list */
-        addToLL(tgtDir->nodedata.dir_dta.files, 0, file);
+        /* Add to the file list, keeping it in name order */
+        linkChild(tgtDir, childBefore(tgtDir, filename), file);
 
         /* Update the parent's timestamp to reflect the change. */
         updateTimestamp(tgtDir);
@@ -212,14 +989,15 @@ long filesizeOfDirTree(DirTree tree, char *path[]) {
         /* Current node is the root. */
 
         long size = 0; /* Size of the directory node */
+        DirTree child;
         
         /* File check */
         if (tree->is_file)
-            return tree->nodedata.file_dta.size;
+            return INODES.size[tree->ino];
         
         /* Node is a directory, so it is a combo of sizes. */
-        for (int i = sizeOfLL(tree->nodedata.dir_dta.files) - 1; i >= 0; i--)
-            size += filesizeOfDirTree((DirTree) getFromLL(tree->nodedata.dir_dta.files, i), NULL);
+        for (child = tree->nodedata.dir_dta->first_child; child; child = child->next_sibling)
+            size += filesizeOfDirTree(child, NULL);
 
         return size;
     } else {
@@ -234,16 +1012,17 @@ long numFilesInTreeDir(DirTree tree, char *dir[], int rec) {
     else if (dir && dir[0]) /* Recursive initial condition */
         return numFilesInTreeDir(getDirSubtree(tree, dir), NULL, rec);
     else {
-        int i;
+        ChildView view;
+        DirTree sub;
         long count = 0;
         
         /* Check each subfile */
-        for (i = sizeOfLL(tree->nodedata.dir_dta.files) - 1; i >= 0; i--) {
-            DirTree sub = getFromLL(tree->nodedata.dir_dta.files, i);
+        viewDirChildren(tree, &view);
+        while ((sub = nextDirChild(&view))) {
 
             /* Only count directories if recursively checking */
             if (sub->is_file)
-                count += sub->nodedata.file_dta.size;
+                count += INODES.size[sub->ino];
             else
                 count += rec ? numFilesInTreeDir(sub, NULL, rec) : 0;
         }
@@ -256,86 +1035,56 @@ long treeFileSize(DirTree tree, char *path[]) {
     DirTree file = path ? getDirSubtree(tree, path) : tree;
 
     if (file->is_file)
-        return file->nodedata.file_dta.size;
+        return INODES.size[file->ino];
     else
         return 0;
 }
 
 
-int rmfileFromTree(DirTree tree, char *path[]) {
-   if (!tree)
-        return 1;
-    else if (!path || !path[0]) {
-        /* This file is the target */
-        DirTree parent = tree->parent_dir;
-        
-        if (!(tree->is_file)) {
-            /* Node is not for a file */
-            return 2;
-        }
-        
-        /* Remove the linking from the tree */
-        if (parent) {
+/**
+ * Unlinks and disposes of the node at the end of a path, if it has
+ * the right type. Directories must be empty.
+ */
+static int rmNodeFromTree(DirTree tree, char *path[], int is_file) {
+    DirTree dir, node;
+    char **subpath;
+    char *name;
 
-            /* Update the parent with the change */
-            updateTimestamp(parent);
+    if (!tree || !path || !path[0])
+        return 1;
 
-            remFromLL(parent->nodedata.dir_dta.files, indexOfLL(parent->nodedata.dir_dta.files, tree));
-            tree->parent_dir = NULL;
-        }
+    subpath = parentOfPath(path, &name);
+    dir = getDirSubtree(tree, subpath);
+    free(subpath);
 
-        /* Handle the destruction of the file */
-        while (sizeOfLL(tree->nodedata.file_dta.blocks))
-            remFromLL(tree->nodedata.file_dta.blocks, 0);
+    node = findDirChild(dir, name);
 
-        /* Zero the file data */
-        tree->nodedata.file_dta.size = 0;
+    if (!node) {
+        /* Nothing by that name */
+        return 1;
+    } else if (node->is_file != is_file) {
+        /* Node is of the other type */
+        return 2;
+    } else if (!is_file && node->nodedata.dir_dta->first_child) {
+        /* Do not allow a directory with contents to be destroyed */
+        return 3;
+    }
 
-        free(tree->nodedata.file_dta.blocks);
-        tree->nodedata.file_dta.blocks = NULL;
+    /* Update the parent with the change */
+    updateTimestamp(dir);
+    unlinkChild(dir, node);
 
-        free(tree);
+    dropNode(node, NULL);
 
-        return 0;
+    return 0;
+}
 
-    } else
-        return rmfileFromTree(getDirSubtree(tree, path), NULL);
+int rmfileFromTree(DirTree tree, char *path[]) {
+    return rmNodeFromTree(tree, path, 1);
 }
 
 int rmdirFromTree(DirTree tree, char *path[]) {
-   if (!tree)
-        return 1;
-    else if (!path || !path[0]) {
-        /* This file is the target */
-        DirTree parent = tree->parent_dir;
-        
-        if (tree->is_file) {
-            /* Node is a file */
-            return 2;
-        } else if (sizeOfLL(tree->nodedata.file_dta.blocks)) {
-            /* Do not allow a directory with contents to be destroyed */
-            return 3;
-        }
-        
-        if (parent) {
-            /* Update the parent's timestamp */
-            updateTimestamp(parent);
-
-            /* Remove linking with parent */
-            remFromLL(parent->nodedata.dir_dta.files, indexOfLL(parent->nodedata.dir_dta.files, tree));
-            tree->parent_dir = NULL;
-        }
-
-        /* Zero the file data */
-        free(tree->nodedata.dir_dta.files);
-        tree->nodedata.dir_dta.files = NULL;
-
-        free(tree);
-
-        return 0;
-
-    } else
-        return rmfileFromTree(getDirSubtree(tree, path), NULL);
+    return rmNodeFromTree(tree, path, 0);
 }
 
 int isTreeFile(DirTree tree) {
@@ -343,88 +1092,44 @@ int isTreeFile(DirTree tree) {
 }
 
 char* getTreeFilename(DirTree tree) {
-    return tree->name;
+    return tree->id->name;
 }
 
-LList getDirTreeChildren(DirTree tree, int alphabetize) {
+LList getDirTreeChildren(DirTree tree) {
     LList list = makeLL();
-    int i;
-    
-    if (!tree || tree->is_file)
-        return list;
-    else if (!alphabetize) /* Simply clone if not adjusting order */
-        return cloneLL(tree->nodedata.dir_dta.files);
-    
-    /* Add each item in alphabetical order */
-    for (i = sizeOfLL(tree->nodedata.dir_dta.files) - 1; i >= 0; i--) {
-        /* Get an item */
-        DirTree elem = (DirTree) getFromLL(tree->nodedata.dir_dta.files, i);
+    ChildView view;
+    DirTree child;
 
-        /* Create a new iterator */
-        LLiter iter = makeLLiter(list);
-        
-        int j;
-        /* Iterate until the needed item is found. */
-        for (j = 0; iterHasNextLL(iter); j++) {
-            DirTree tst = (DirTree) iterNextLL(iter);
-            if (strcmp(tst->name, elem->name) < 0) {
-                break;
-            }
-        }
-
-        disposeIterLL(iter);
-
-        addToLL(list, j+1, elem);
-
-    }
+    /* Children are kept in name order, so there is nothing to sort */
+    viewDirChildren(tree, &view);
+    while ((child = nextDirChild(&view)))
+        appendToLL(list, child);
 
     return list;
-
 }
 
-char** pathVecOfTree(DirTree tree) {
-    char *name;
+/* The path vector of an identity, from its root's name down */
+static char** pathVecOfName(TreeName id) {
+    TreeName up;
     char **vec;
+    int i = 0;
 
-    if (!tree)
-        return NULL;
-    
-    name = tree->name;
-    
-    if (tree->parent_dir == NULL || tree->parent_dir == tree) {
-        /* Tree is root */
-        vec = (char**) malloc(2*sizeof(char*));
-
-        vec[0] = (char*) malloc((1 + strlen(name)) * sizeof(char));
-        strcpy(vec[0], name);
-
-        vec[1] = NULL;
-    } else {
-        /* Tree is not root */
-        char **par_vec = pathVecOfTree(tree->parent_dir);
-        int i;
-
-        for (i = 0; par_vec[i]; i++);
-        par_vec[i] = (char*) malloc((1 + strlen(name)) * sizeof(char));
-        strcpy(par_vec[i], name);
-        
-        /* Add to the path */
-        vec = realloc(par_vec, (i+2) * sizeof(char*));
-        if (!vec) {
-            vec = (char**) malloc((i+2) * sizeof(char*));
-            memcpy(vec, par_vec, (i+1) * sizeof(char*));
-            free_str_vec(par_vec);
-        }
-
-        vec[i+1] = NULL;
-        
-        return vec;
+    for (up = id; up; up = up->parent)
+        i++;
 
+    vec = (char**) malloc((i + 1) * sizeof(char*));
+    vec[i] = NULL;
 
+    for (up = id; up; up = up->parent) {
+        vec[--i] = (char*) malloc((1 + strlen(up->name)) * sizeof(char));
+        strcpy(vec[i], up->name);
     }
 
     return vec;
+}
 
+char** pathVecOfTree(DirTree tree) {
+    return tree ? pathVecOfName(tree->id) : NULL;
 }
 
 time_t getTreeTimestamp(DirTree tree) {
@@ -434,18 +1139,52 @@ time_t getTreeTimestamp(DirTree tree) {
         return time(NULL);
 }
 
-LList getTreeFileBlocks(DirTree file) {
-    
-    if (!file || !(file->is_file))
+Extent* getTreeFileExtents(DirTree file, long *n) {
+
+    if (!file || !(file->is_file)) {
+        *n = 0;
         return NULL;
-    else
-        return cloneLL(file->nodedata.file_dta.blocks);
+    }
 
+    *n = file->nodedata.file_dta->num_extents;
+    return file->nodedata.file_dta->extents;
+
+}
+
+long getTreeBlockCount(DirTree file) {
+    if (file && file->is_file)
+        return file->nodedata.file_dta->num_blocks;
+    else
+        return 0;
 }
 
 void updateFileSize(DirTree tree, long newSize) {
     if (tree && tree->is_file)
-        tree->nodedata.file_dta.size = newSize;
+        INODES.size[tree->ino] = newSize;
+}
+
+long getDelayedBlocks(DirTree tree) {
+    if (tree && tree->is_file)
+        return tree->nodedata.file_dta->delayed;
+    else
+        return 0;
+}
+
+void setDelayedBlocks(DirTree tree, long n) {
+    if (tree && tree->is_file)
+        tree->nodedata.file_dta->delayed = n;
+}
+
+LLnode getPendingItem(DirTree tree) {
+    if (tree && tree->is_file)
+        return tree->nodedata.file_dta->pending;
+    else
+        return NULL;
+}
+
+void setPendingItem(DirTree tree, LLnode item) {
+    if (tree && tree->is_file)
+        tree->nodedata.file_dta->pending = item;
 }
 
 void updateTimestamp(DirTree tree) {
@@ -458,34 +1197,387 @@ void setTimestamp(DirTree tree, time_t t) {
         tree->timestamp = t;
 }
 
+/**
+ * Makes room for at least n extents in a file's block map.
+ */
+static void reserveExtents(FileData file, long n) {
+    if (n <= file->cap_extents)
+        return;
+
+    file->cap_extents = file->cap_extents ? 2 * file->cap_extents : 4;
+    if (file->cap_extents < n)
+        file->cap_extents = n;
+
+    file->extents = (Extent*) growTreeData(file->extents, file->num_extents * sizeof(Extent),
+                                          file->cap_extents * sizeof(Extent));
+}
+
+/**
+ * Binary search of the block map by logical offset.
+ *
+ * return - The index of the last run starting at or before the
+ *          offset, or -1 if every run starts after it.
+ */
+static long findExtent(FileData file, long offset) {
+    long lo = 0, hi = file->num_extents;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        if (file->extents[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo - 1;
+}
+
+/* Whether run b carries on from run a, both logically and on disk */
+static int continuesExtent(Extent *a, Extent *b) {
+    return a->offset + a->len == b->offset && a->start + a->len == b->start;
+}
+
+/* Removes run i from the block map */
+static void dropExtent(FileData file, long i) {
+    memmove(&file->extents[i], &file->extents[i + 1], (file->num_extents - i - 1) * sizeof(Extent));
+    file->num_extents--;
+}
+
 void assignMemoryBlock(DirTree tree, long blk) {
-    long *tmp;
+    assignMemoryRun(tree, blk, 1);
+}
+
+void assignMemoryRun(DirTree tree, long start, long len) {
+    FileData file;
+    Extent *tail;
+
+    if (!tree || !(tree->is_file))
+        return;
+
+    file = tree->nodedata.file_dta;
+    tail = file->num_extents ? &file->extents[file->num_extents - 1] : NULL;
+
+    assignMemoryRunAt(tree, tail ? tail->offset + tail->len : 0, start, len);
+}
+
+void assignMemoryRunAt(DirTree tree, long offset, long start, long len) {
+    FileData file;
+    Extent run;
+    long i;
+    int with_prev, with_next;
     
     /* Edge case checks */
-    if (!tree)
+    if (!tree || len <= 0 || offset < 0)
         return;
     else if (!(tree->is_file))
         return;
-    
-    tmp = (long*) malloc(sizeof(long));
-    *tmp = blk;
 
-    addToLL(tree->nodedata.file_dta.blocks, 0, tmp);
+    file = tree->nodedata.file_dta;
+
+    run.start = start;
+    run.len = len;
+    run.offset = offset;
+
+    setBlockOwners(file, start, len, offset);
+
+    /* The run goes between runs i and i+1 */
+    i = findExtent(file, offset);
+    with_prev = i >= 0 && continuesExtent(&file->extents[i], &run);
+    with_next = i + 1 < file->num_extents && continuesExtent(&run, &file->extents[i + 1]);
+
+    if (with_prev && with_next) {
+        /* Fills the gap between two runs */
+        file->extents[i].len += len + file->extents[i + 1].len;
+        dropExtent(file, i + 1);
+    } else if (with_prev) {
+        file->extents[i].len += len;
+    } else if (with_next) {
+        file->extents[i + 1].start = start;
+        file->extents[i + 1].offset = offset;
+        file->extents[i + 1].len += len;
+    } else {
+        reserveExtents(file, file->num_extents + 1);
+        memmove(&file->extents[i + 2], &file->extents[i + 1], (file->num_extents - i - 1) * sizeof(Extent));
+        file->extents[i + 1] = run;
+        file->num_extents++;
+    }
+
+    file->num_blocks += len;
+}
+
+long mapMemoryOffset(DirTree tree, long offset, long *run_end) {
+    FileData file;
+    long i;
+
+    *run_end = LONG_MAX;
+
+    if (!tree || !(tree->is_file) || offset < 0)
+        return -1;
+
+    file = tree->nodedata.file_dta;
+    i = findExtent(file, offset);
+
+    if (i >= 0 && offset < file->extents[i].offset + file->extents[i].len) {
+        *run_end = file->extents[i].offset + file->extents[i].len;
+        return file->extents[i].start + offset - file->extents[i].offset;
+    }
+
+    /* A hole, up to the next run if there is one */
+    if (i + 1 < file->num_extents)
+        *run_end = file->extents[i + 1].offset;
+
+    return -1;
+}
+
+long lastMemoryBlock(DirTree tree) {
+    FileData file;
+
+    if (!tree || !(tree->is_file) || !tree->nodedata.file_dta->num_extents)
+        return -1;
+
+    file = tree->nodedata.file_dta;
+
+    return file->extents[file->num_extents - 1].start
+           + file->extents[file->num_extents - 1].len - 1;
 }
 
 long releaseMemoryBlock(DirTree tree) {
-    long *res;
+    FileData file;
+    Extent *tail;
     long val;
 
-    if (!tree || !(tree->is_file))
+    if (!tree || !(tree->is_file) || !tree->nodedata.file_dta->num_extents)
         return -1;
 
-    res = (long*) remFromLL(tree->nodedata.file_dta.blocks, 0);
-    val = *res;
-    free(res);
+    /* Shrink the last run from its end */
+    file = tree->nodedata.file_dta;
+    tail = &file->extents[file->num_extents - 1];
+
+    val = tail->start + tail->len - 1;
+    clearBlockOwners(file, val, 1);
+
+    if (!--tail->len)
+        file->num_extents--;
+    file->num_blocks--;
 
     return val;
 }
 
+/**
+ * Cuts the block map short: run first keeps only its first keep
+ * blocks, and every run after it is dropped. The blocks cut off are
+ * handed back as runs.
+ */
+static long trimExtents(DirTree tree, long first, long keep, RunVec *runs) {
+    FileData file = tree->nodedata.file_dta;
+    long nruns = file->num_extents - first;
+    long i;
+
+    if (nruns <= 0)
+        return 0;
+
+    /* Hand back the dropped runs, the first of them trimmed to its tail */
+    for (i = first; i < file->num_extents; i++) {
+        Extent *ext = &file->extents[i];
+        long cut = i == first ? keep : 0;
+
+        pushRunVec(runs, ext->start + cut, ext->len - cut, ext->offset + cut);
+        clearBlockOwners(file, ext->start + cut, ext->len - cut);
+        file->num_blocks -= ext->len - cut;
+    }
+
+    file->extents[first].len = keep;
+    file->num_extents = keep ? first + 1 : first;
+
+    return nruns;
+}
+
+long releaseMemoryFrom(DirTree tree, long offset, RunVec *runs) {
+    FileData file;
+    long i;
+
+    if (!tree || !(tree->is_file))
+        return 0;
+
+    file = tree->nodedata.file_dta;
+    if (offset < 0)
+        offset = 0;
+
+    i = findExtent(file, offset);
+
+    if (i < 0)
+        return trimExtents(tree, 0, 0, runs);
+    else if (offset < file->extents[i].offset + file->extents[i].len)
+        return trimExtents(tree, i, offset - file->extents[i].offset, runs);
+    else
+        return trimExtents(tree, i + 1, 0, runs);
+}
+
+/* Moves a map's block from one disk block to another */
+static int relocateInMap(FileData file, long from, long to) {
+    Extent *ext;
+    long offset, i, before, after;
+
+    /* Find the run holding the block, through the owner map if it can */
+    offset = ownerOffset(file, from);
+    if (offset >= 0) {
+        i = findExtent(file, offset);
+    } else {
+        for (i = 0; i < file->num_extents; i++) {
+            ext = &file->extents[i];
+            if (ext->start <= from && from < ext->start + ext->len)
+                break;
+        }
+    }
+
+    if (i < 0 || i == file->num_extents)
+        return 1;
+
+    ext = &file->extents[i];
+    if (from < ext->start || from >= ext->start + ext->len)
+        return 1;
+
+    /* [start, from) [to] [from+1, end): split the run in up to three */
+    before = from - ext->start;
+    after = ext->start + ext->len - from - 1;
+    offset = ext->offset + before;
+
+    clearBlockOwners(file, from, 1);
+    setBlockOwners(file, to, 1, offset);
+
+    reserveExtents(file, file->num_extents + 2);
+
+    if (before) {
+        memmove(&file->extents[i + 1], &file->extents[i], (file->num_extents - i) * sizeof(Extent));
+        file->extents[i].len = before;
+        file->num_extents++;
+        i++;
+    }
+
+    file->extents[i].start = to;
+    file->extents[i].offset = offset;
+    file->extents[i].len = 1;
+
+    if (after) {
+        memmove(&file->extents[i + 2], &file->extents[i + 1], (file->num_extents - i - 1) * sizeof(Extent));
+        file->extents[i + 1].start = from + 1;
+        file->extents[i + 1].offset = offset + 1;
+        file->extents[i + 1].len = after;
+        file->num_extents++;
+    }
+
+    /* Merge the moved block into whichever neighbours it now continues */
+    if (i + 1 < file->num_extents && continuesExtent(&file->extents[i], &file->extents[i + 1])) {
+        file->extents[i].len += file->extents[i + 1].len;
+        dropExtent(file, i + 1);
+    }
+    if (i > 0 && continuesExtent(&file->extents[i - 1], &file->extents[i])) {
+        file->extents[i - 1].len += file->extents[i].len;
+        dropExtent(file, i);
+    }
+
+    return 0;
+}
+
+int relocateMemoryBlock(DirTree tree, long from, long to) {
+    if (!tree || !(tree->is_file))
+        return 1;
+
+    return relocateInMap(tree->nodedata.file_dta, from, to);
+}
+
+void relocateBlockHolders(long from, long to) {
+    ExtNode ext = BLOCK_OWNERS ? findInET(BLOCK_OWNERS, from) : NULL;
+    struct blockowner *owner;
+    FileData *maps;
+    long n = 0, i;
+
+    if (!ext)
+        return;
+
+    /* Relocating changes the holder lists, so take a copy first */
+    for (owner = (struct blockowner*) extValET(ext); owner; owner = owner->next)
+        n++;
+
+    maps = (FileData*) malloc(n * sizeof(FileData));
+    for (i = 0, owner = (struct blockowner*) extValET(ext); owner; owner = owner->next)
+        maps[i++] = owner->file;
+
+    for (i = 0; i < n; i++)
+        relocateInMap(maps[i], from, to);
+
+    free(maps);
+}
+
+void initBlockOwners(long blocks) {
+    flushBlockOwners();
+
+    if (!OWNER_RECORDS)
+        OWNER_RECORDS = makePool("block owners", sizeof(struct blockowner));
+
+    OWNED_BLOCKS = blocks > 0 ? blocks : 0;
+    BLOCK_OWNERS = makeET();
+}
+
+void flushBlockOwners() {
+    ExtNode ext;
+
+    if (!BLOCK_OWNERS)
+        return;
+
+    for (ext = firstET(BLOCK_OWNERS); ext; ext = nextET(ext))
+        freeOwners((struct blockowner*) extValET(ext));
+
+    flushET(BLOCK_OWNERS);
+    BLOCK_OWNERS = NULL;
+    OWNED_BLOCKS = 0;
+}
+
+BlockMap getTreeBlockMap(DirTree file) {
+    return file && file->is_file ? file->nodedata.file_dta : NULL;
+}
+
+BlockMap getBlockHolder(long blk, long i, long *offset) {
+    ExtNode ext = BLOCK_OWNERS ? findInET(BLOCK_OWNERS, blk) : NULL;
+    struct blockowner *owner = ext ? (struct blockowner*) extValET(ext) : NULL;
+
+    for (; owner && i > 0; i--)
+        owner = owner->next;
+
+    if (!owner)
+        return NULL;
+
+    if (offset)
+        *offset = owner->offset + blk - extStartET(ext);
+
+    return owner->file;
+}
 
+long getBlockOffset(DirTree file, long blk) {
+    return file && file->is_file ? ownerOffset(file->nodedata.file_dta, blk) : -1;
+}
+
+DirTree findBlockMap(DirTree root, BlockMap map) {
+    DirTree node = root && map ? findByName(root, map->id) : NULL;
+
+    return node && node->is_file && node->nodedata.file_dta == map ? node : NULL;
+}
 
+long ownerRunEnd(long lo, long hi) {
+    ExtNode ext;
+
+    if (hi > OWNED_BLOCKS)
+        hi = OWNED_BLOCKS;
+    if (lo < 0 || lo >= hi)
+        return lo;
+
+    /* Owned runs are whole extents, since continuing ones are merged */
+    ext = findInET(BLOCK_OWNERS, lo);
+    if (ext)
+        return extEndET(ext) < hi ? extEndET(ext) : hi;
+
+    /* Unowned blocks run up to the next extent */
+    ext = ceilET(BLOCK_OWNERS, lo);
+    return ext && extStartET(ext) < hi ? extStartET(ext) : hi;
+}
@@ -11,9 +11,37 @@
 
 #include <time.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct dirtree;
 typedef struct dirtree* DirTree;
 
+/**
+ * A file's block map. Trees that share a file (see shareDirTree)
+ * share its map until one of them changes it.
+ */
+struct filedata;
+typedef struct filedata* BlockMap;
+
+/**
+ * A run of len consecutive blocks beginning at block start. In a
+ * file's block map, offset is the logical block of the file that
+ * the run begins at; runs from the allocator count it from 0 across
+ * the request instead.
+ */
+struct extent {
+    long start;
+    long len;
+    long offset;
+};
+typedef struct extent Extent;
+
+/* A growable list of runs that its caller owns; see runvec.h */
+struct runvec;
+typedef struct runvec RunVec;
+
 long BLOCK_SIZE;
 
 /**
@@ -24,17 +52,86 @@ DirTree makeDirTree(char *name, int is_file);
 
 /**
  * Disposes of a tree and any subtrees it has. The given
- * tree and any affected data will be freed.
+ * tree and any affected data will be freed. Data still shared
+ * with another tree is kept for it.
  */
 void flushDirTree(DirTree tree);
 
 /**
- * Gets the subtree, supertree or relative tree of the given tree
- * found by following the given path.
+ * Disposes of a tree like flushDirTree, handing back the blocks of
+ * every block map that no other tree shares.
+ *
+ * runs - An initialized list that the maps' runs are appended to.
+ *        Runs of different maps may overlap.
+ *
+ * return - The number of runs appended.
+ */
+long dropDirTree(DirTree tree, RunVec *runs);
+
+/**
+ * Selects where nodes' names and block maps' runs are allocated: one
+ * at a time from the heap (the default), or from an arena that is
+ * only released as a whole by resetDirTrees. Nodes, block maps and
+ * directories' lists always come from pools. Must be called while no
+ * tree exists.
+ */
+void useTreeArena(int on);
+
+/**
+ * Disposes of every tree at once without visiting any node. Only
+ * complete in arena mode; the block owner map is not updated.
+ */
+void resetDirTrees();
+
+/**
+ * Makes a new root, under the given name, that shares everything
+ * under a tree in O(1). Nothing is copied until one side changes:
+ * see ownTreePath.
+ *
+ * return - The new root.
+ */
+DirTree shareDirTree(DirTree tree, char *name);
+
+/**
+ * Makes the nodes on the path from root to a tree safe to change,
+ * copying whatever they share with another tree: each directory on
+ * the way gets its own list of children, and a file its own block
+ * map, which is recorded as a holder of the blocks. Nodes off the
+ * path stay shared, and the copied nodes replace the old ones.
+ *
+ * tree   - A node of root's tree, or of a tree shared with it, which
+ *          is found again in root's tree by its path.
+ * copied - Receives whether anything was copied.
+ *
+ * return - The node of root's tree at the same path, or NULL if
+ *          there is none.
+ */
+DirTree ownTreePath(DirTree root, DirTree tree, int *copied);
+
+/* The node of root's tree at the same path as tree, or NULL */
+DirTree findTreeNode(DirTree root, DirTree tree);
+
+/**
+ * Gives a file with no blocks the same blocks as another file. The
+ * copy is recorded as their holder alongside the original.
+ *
+ * return - Nonzero if either node is not a file, or dst has blocks.
+ */
+int copyFileBlocks(DirTree src, DirTree dst);
+
+/**
+ * Gets the subtree of the given tree found by following the given
+ * path. For the way back up, see getTreeParent.
  */
 DirTree getDirSubtree(DirTree tree, char *path[]);
 
-DirTree getTreeParent(DirTree);
+/**
+ * The parent of a node in root's tree; the root is its own parent.
+ * Read from the inode table in O(1), unless the node is listed by a
+ * directory shared with another tree, whose parent is then found by
+ * name from root.
+ */
+DirTree getTreeParent(DirTree root, DirTree tree);
 
 /**
  * Adds a directory path to the tree
@@ -59,7 +156,9 @@ int addDirToTree(DirTree tree, char *path[]);
 int addFileToTree(DirTree tree, char *path[]);
 
 /**
- * Removes a file from the system.
+ * Removes a file from the system. Its blocks should be revoked
+ * first. The directory holding it must not share its children with
+ * another tree (see ownTreePath).
  * path - The filepath, ending in the filename.
  *
  * return - A nonzero error code if something went wrong:
@@ -69,12 +168,14 @@ int addFileToTree(DirTree tree, char *path[]);
 int rmfileFromTree(DirTree tree, char *path[]);
 
 /**
- * Removes a directory from the system.
+ * Removes an empty directory from the system. Like rmfileFromTree,
+ * its parent must not share its children.
  * path - The filepath, ending in the filename.
  *
  * return - A nonzero error code if something went wrong:
  *          1 - File not found.
  *          2 - Tried to remove file when directory expected.
+ *          3 - The directory is not empty.
  */
 int rmdirFromTree(DirTree tree, char *path[]);
 
@@ -101,12 +202,52 @@ long treeFileSize(DirTree tree, char *filepath[]);
 int isTreeFile(DirTree tree);
 
 /**
- * The children of the given tree root.
+ * A copy of the list of children of the given tree root, which are
+ * always in name order.
+ */
+LList getDirTreeChildren(DirTree tree);
+
+/**
+ * A borrowed, read-only view of a directory's children, in name
+ * order. It can live on the stack and allocates nothing. The child
+ * last returned may be unlinked, but any other change to the
+ * directory invalidates the view.
+ */
+struct childview {
+    DirTree next;
+};
+typedef struct childview ChildView;
+
+/* Starts a view of a directory's children; a file has none */
+void viewDirChildren(DirTree dir, ChildView *view);
+
+/* The next child in the view, or NULL once every child has been seen */
+DirTree nextDirChild(ChildView *view);
+
+long numDirChildren(DirTree dir);
+
+/**
+ * Called on each node of a tree walk. A nonzero return stops the walk.
  */
-LList getDirTreeChildren(DirTree tree, int alphabetize);
+typedef int (*TreeVisitor)(DirTree node, void *arg);
 
 /**
- * Generates the path vector of a given directory or file node.
+ * Visits root and everything under it breadth first, each directory's
+ * children in name order. Pending nodes wait in a ring buffer that
+ * grows to the widest level of the tree, so the whole walk makes only
+ * a handful of allocations. The tree must not change during the walk.
+ *
+ * return - The visitor's nonzero return, or 0 once every node is seen.
+ */
+int walkDirTree(DirTree root, TreeVisitor visit, void *arg);
+
+/* The child of a directory with the given name, or NULL */
+DirTree findDirChild(DirTree dir, char *name);
+
+/**
+ * Generates the path vector of a given directory or file node. The
+ * first element is the name of the live tree's root, even for a
+ * node that is only in a tree shared with it.
  */
 char** pathVecOfTree(DirTree tree);
 
@@ -121,13 +262,23 @@ char* getTreeFilename(DirTree tree);
 time_t getTreeTimestamp(DirTree);
 
 /**
- * Retrieves a copy of the block list for a given file node.
+ * Retrieves the block map of a given file node: its blocks as runs,
+ * in logical order. Runs that continue one another are always merged.
+ * A file may be sparse, so there can be gaps between the offsets of
+ * consecutive runs.
  *
  * file - A DirTree that is known to be a file.
+ * n    - Receives the number of runs.
  *
- * return - A clone of the block list.
+ * return - The file's own run array, valid until its blocks next
+ *          change. It must not be modified or freed.
+ */
+Extent* getTreeFileExtents(DirTree file, long *n);
+
+/**
+ * The number of blocks held by a file.
  */
-LList getTreeFileBlocks(DirTree file);
+long getTreeBlockCount(DirTree file);
 
 /**
  * Updates the file with a new size. Should be called whenever
@@ -135,6 +286,20 @@ LList getTreeFileBlocks(DirTree file);
  */
 void updateFileSize(DirTree, long);
 
+/**
+ * The number of blocks a file has been promised under delayed
+ * allocation but not yet given.
+ */
+long getDelayedBlocks(DirTree file);
+void setDelayedBlocks(DirTree file, long n);
+
+/**
+ * The item of a list that a file with delayed blocks is kept in, so
+ * that it can be removed without a search. NULL if it has none.
+ */
+LLnode getPendingItem(DirTree file);
+void setPendingItem(DirTree file, LLnode item);
+
 /**
  * Updates timestamp of a tree node. Should be called whenever
  * a file is modified.
@@ -147,7 +312,7 @@ void updateTimestamp(DirTree);
 void setTimestamp(DirTree, time_t);
 
 /**
- * Assigns a block of memory to a file.
+ * Assigns a block of memory to a file, after its last block.
  * precondition - Block b has already been allocated.
  *
  * file - A DirTree node that corresponds to a file that shoud
@@ -157,7 +322,40 @@ void setTimestamp(DirTree, time_t);
 void assignMemoryBlock(DirTree file, long b);
 
 /**
- * Revokes a block of memory from a file. Assumes that the user
+ * Assigns a run of consecutive blocks to a file, in order, after
+ * its last block.
+ * precondition - Blocks [start, start+len) are already allocated.
+ */
+void assignMemoryRun(DirTree file, long start, long len);
+
+/**
+ * Assigns a run of consecutive blocks to a file at a logical offset,
+ * filling (part of) a hole.
+ * precondition - Blocks [start, start+len) are already allocated, and
+ *                the file has no blocks at [offset, offset+len).
+ */
+void assignMemoryRunAt(DirTree file, long offset, long start, long len);
+
+/**
+ * Looks up the block at a logical offset of a file.
+ *
+ * run_end - Receives the offset where the run holding the block
+ *           ends, or where the hole ends if there is no block there
+ *           (LONG_MAX for a hole past the last run).
+ *
+ * return - The block id, or -1 if the offset falls in a hole.
+ */
+long mapMemoryOffset(DirTree file, long offset, long *run_end);
+
+/**
+ * The last block of a file, in logical order.
+ *
+ * return - The block id, or -1 if the file has no blocks.
+ */
+long lastMemoryBlock(DirTree file);
+
+/**
+ * Revokes the last block of memory from a file. Assumes that the user
  * will follow up by freeing the provided block id.
  *
  * file - A DirTree corresponding to a file.
@@ -167,4 +365,80 @@ void assignMemoryBlock(DirTree file, long b);
  */
 long releaseMemoryBlock(DirTree file);
 
+/**
+ * Revokes every block of a file at or past a logical offset at once,
+ * as runs. Assumes that the user will follow up by freeing the runs.
+ *
+ * file   - A DirTree corresponding to a file.
+ * offset - The first logical block to revoke.
+ * runs   - An initialized list that the revoked runs are appended
+ *          to, in logical order.
+ *
+ * return - The number of runs appended.
+ */
+long releaseMemoryFrom(DirTree file, long offset, RunVec *runs);
+
+/**
+ * Moves a file's data from one block to another, keeping its
+ * place in the file. The caller allocates the new block and frees
+ * the old one.
+ *
+ * return - Nonzero if the file does not hold block from.
+ */
+int relocateMemoryBlock(DirTree file, long from, long to);
+
+/**
+ * Moves a block to another in every block map that holds it, as
+ * relocateMemoryBlock does for one file.
+ */
+void relocateBlockHolders(long from, long to);
+
+/**
+ * Sets up the reverse block map for blocks [0, blocks), with no
+ * block owned, or disposes of it. Blocks outside the map are never
+ * given an owner. The map keeps one extent per run of blocks with
+ * the same holders, not one entry per block.
+ */
+void initBlockOwners(long blocks);
+void flushBlockOwners();
+
+/* The block map of a file node, or NULL for a directory */
+BlockMap getTreeBlockMap(DirTree file);
+
+/**
+ * Finds the block maps holding a block, in O(log n) for n owner
+ * extents. A map shared by several trees holds a block once.
+ *
+ * blk    - The block id.
+ * i      - Which holder to give, counting from 0, the latest first.
+ * offset - If not NULL, receives the block's place in the map,
+ *          counting from 0.
+ *
+ * return - The map, or NULL if fewer than i+1 maps hold the block.
+ */
+BlockMap getBlockHolder(long blk, long i, long *offset);
+
+/**
+ * The logical block at which a file holds a block, or -1 if it does
+ * not hold it.
+ */
+long getBlockOffset(DirTree file, long blk);
+
+/* The file of root's tree that has the given block map, or NULL */
+DirTree findBlockMap(DirTree root, BlockMap map);
+
+/**
+ * Range query over the reverse block map: the end of the run of
+ * blocks from lo, stopping before hi, that are either all held by
+ * the same block maps at consecutive offsets or all held by none.
+ * Costs one lookup, however long the run.
+ *
+ * return - The first block past the run, or lo if the range is empty.
+ */
+long ownerRunEnd(long lo, long hi);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
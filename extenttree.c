@@ -0,0 +1,456 @@
+#include "extenttree.h"
+#include "pool.h"
+
+#include <stdlib.h>
+
+#define RED   1
+#define BLACK 0
+
+struct extnode {
+    long start;
+    long end;
+    void *val;
+
+    int colour;
+    struct extnode *left;
+    struct extnode *right;
+    struct extnode *parent;
+
+    /* The sentinel of the tree the node belongs to */
+    struct extnode *nil;
+};
+
+struct extenttree {
+    ExtNode root;
+    long size;
+
+    /* Shared leaf sentinel; always black */
+    struct extnode nil;
+};
+
+
+/* Every extent of every tree comes from here, made on first use */
+Pool ET_NODES = NULL;
+
+
+ExtTree makeET() {
+    ExtTree tree = (ExtTree) malloc(sizeof(struct extenttree));
+
+    if (!ET_NODES)
+        ET_NODES = makePool("extents", sizeof(struct extnode));
+
+    tree->nil.start = tree->nil.end = 0;
+    tree->nil.val = NULL;
+    tree->nil.colour = BLACK;
+    tree->nil.left = tree->nil.right = tree->nil.parent = &tree->nil;
+    tree->nil.nil = &tree->nil;
+
+    tree->root = &tree->nil;
+    tree->size = 0;
+
+    return tree;
+}
+
+static void flushNodesET(ExtNode node) {
+    /* Iterative post-order teardown using the parent links. */
+    while (node != node->nil) {
+        if (node->left != node->nil)
+            node = node->left;
+        else if (node->right != node->nil)
+            node = node->right;
+        else {
+            ExtNode parent = node->parent;
+
+            if (parent != node->nil) {
+                if (parent->left == node)
+                    parent->left = node->nil;
+                else
+                    parent->right = node->nil;
+            }
+
+            giveToPool(ET_NODES, node);
+            node = parent;
+        }
+    }
+}
+
+void flushET(ExtTree tree) {
+    if (!tree)
+        return;
+
+    flushNodesET(tree->root);
+    free(tree);
+}
+
+long sizeOfET(ExtTree tree) {
+    return tree ? tree->size : 0;
+}
+
+int isEmptyET(ExtTree tree) {
+    return !tree || !tree->size;
+}
+
+/* Maps the sentinel back to NULL for callers. */
+static ExtNode pubET(ExtNode node) {
+    return node == node->nil ? NULL : node;
+}
+
+ExtNode floorET(ExtTree tree, long blk) {
+    ExtNode curr, best;
+
+    if (!tree)
+        return NULL;
+
+    best = &tree->nil;
+    curr = tree->root;
+    while (curr != &tree->nil) {
+        if (curr->start <= blk) {
+            best = curr;
+            curr = curr->right;
+        } else
+            curr = curr->left;
+    }
+
+    return pubET(best);
+}
+
+ExtNode ceilET(ExtTree tree, long blk) {
+    ExtNode curr, best;
+
+    if (!tree)
+        return NULL;
+
+    best = &tree->nil;
+    curr = tree->root;
+    while (curr != &tree->nil) {
+        if (curr->start >= blk) {
+            best = curr;
+            curr = curr->left;
+        } else
+            curr = curr->right;
+    }
+
+    return pubET(best);
+}
+
+ExtNode findInET(ExtTree tree, long blk) {
+    ExtNode node = floorET(tree, blk);
+
+    return node && blk < node->end ? node : NULL;
+}
+
+static ExtNode minNodeET(ExtNode node) {
+    while (node->left != node->nil)
+        node = node->left;
+    return node;
+}
+
+static ExtNode maxNodeET(ExtNode node) {
+    while (node->right != node->nil)
+        node = node->right;
+    return node;
+}
+
+ExtNode firstET(ExtTree tree) {
+    return isEmptyET(tree) ? NULL : minNodeET(tree->root);
+}
+
+ExtNode lastET(ExtTree tree) {
+    return isEmptyET(tree) ? NULL : maxNodeET(tree->root);
+}
+
+ExtNode nextET(ExtNode node) {
+    ExtNode parent;
+
+    if (!node)
+        return NULL;
+    else if (node->right != node->nil)
+        return minNodeET(node->right);
+
+    /* Climb until we arrive from a left subtree */
+    parent = node->parent;
+    while (parent != node->nil && node == parent->right) {
+        node = parent;
+        parent = parent->parent;
+    }
+
+    return pubET(parent);
+}
+
+ExtNode prevET(ExtNode node) {
+    ExtNode parent;
+
+    if (!node)
+        return NULL;
+    else if (node->left != node->nil)
+        return maxNodeET(node->left);
+
+    /* Climb until we arrive from a right subtree */
+    parent = node->parent;
+    while (parent != node->nil && node == parent->left) {
+        node = parent;
+        parent = parent->parent;
+    }
+
+    return pubET(parent);
+}
+
+static void rotateLeftET(ExtTree tree, ExtNode x) {
+    ExtNode y = x->right;
+
+    x->right = y->left;
+    if (y->left != &tree->nil)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    if (x->parent == &tree->nil)
+        tree->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotateRightET(ExtTree tree, ExtNode x) {
+    ExtNode y = x->left;
+
+    x->left = y->right;
+    if (y->right != &tree->nil)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    if (x->parent == &tree->nil)
+        tree->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+
+    y->right = x;
+    x->parent = y;
+}
+
+ExtNode insertET(ExtTree tree, long start, long end, void *val) {
+    ExtNode node, parent, curr, z;
+
+    if (!tree)
+        return NULL;
+
+    node = (ExtNode) takeFromPool(ET_NODES);
+    node->start = start;
+    node->end = end;
+    node->val = val;
+    node->colour = RED;
+    node->left = node->right = &tree->nil;
+    node->nil = &tree->nil;
+
+    /* Ordinary BST descent */
+    parent = &tree->nil;
+    curr = tree->root;
+    while (curr != &tree->nil) {
+        parent = curr;
+        curr = start < curr->start ? curr->left : curr->right;
+    }
+
+    node->parent = parent;
+    if (parent == &tree->nil)
+        tree->root = node;
+    else if (start < parent->start)
+        parent->left = node;
+    else
+        parent->right = node;
+
+    tree->size++;
+
+    /* Restore the red-black properties */
+    z = node;
+    while (z->parent->colour == RED) {
+        ExtNode gp = z->parent->parent;
+
+        if (z->parent == gp->left) {
+            ExtNode uncle = gp->right;
+
+            if (uncle->colour == RED) {
+                z->parent->colour = BLACK;
+                uncle->colour = BLACK;
+                gp->colour = RED;
+                z = gp;
+            } else {
+                if (z == z->parent->right) {
+                    z = z->parent;
+                    rotateLeftET(tree, z);
+                }
+                z->parent->colour = BLACK;
+                gp->colour = RED;
+                rotateRightET(tree, gp);
+            }
+        } else {
+            ExtNode uncle = gp->left;
+
+            if (uncle->colour == RED) {
+                z->parent->colour = BLACK;
+                uncle->colour = BLACK;
+                gp->colour = RED;
+                z = gp;
+            } else {
+                if (z == z->parent->left) {
+                    z = z->parent;
+                    rotateRightET(tree, z);
+                }
+                z->parent->colour = BLACK;
+                gp->colour = RED;
+                rotateLeftET(tree, gp);
+            }
+        }
+    }
+    tree->root->colour = BLACK;
+
+    return node;
+}
+
+/* Puts v in the place of u beneath u's parent. */
+static void transplantET(ExtTree tree, ExtNode u, ExtNode v) {
+    if (u->parent == &tree->nil)
+        tree->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+
+    v->parent = u->parent;
+}
+
+void* removeET(ExtTree tree, ExtNode z) {
+    ExtNode x, y;
+    int y_colour;
+    void *val;
+
+    if (!tree || !z)
+        return NULL;
+
+    val = z->val;
+
+    y = z;
+    y_colour = y->colour;
+
+    if (z->left == &tree->nil) {
+        x = z->right;
+        transplantET(tree, z, z->right);
+    } else if (z->right == &tree->nil) {
+        x = z->left;
+        transplantET(tree, z, z->left);
+    } else {
+        /* Replace z with its in-order successor */
+        y = minNodeET(z->right);
+        y_colour = y->colour;
+        x = y->right;
+
+        if (y->parent == z)
+            x->parent = y;
+        else {
+            transplantET(tree, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        transplantET(tree, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->colour = z->colour;
+    }
+
+    if (y_colour == BLACK) {
+        /* x carries an extra black that must be pushed up or absorbed */
+        while (x != tree->root && x->colour == BLACK) {
+            if (x == x->parent->left) {
+                ExtNode w = x->parent->right;
+
+                if (w->colour == RED) {
+                    w->colour = BLACK;
+                    x->parent->colour = RED;
+                    rotateLeftET(tree, x->parent);
+                    w = x->parent->right;
+                }
+
+                if (w->left->colour == BLACK && w->right->colour == BLACK) {
+                    w->colour = RED;
+                    x = x->parent;
+                } else {
+                    if (w->right->colour == BLACK) {
+                        w->left->colour = BLACK;
+                        w->colour = RED;
+                        rotateRightET(tree, w);
+                        w = x->parent->right;
+                    }
+                    w->colour = x->parent->colour;
+                    x->parent->colour = BLACK;
+                    w->right->colour = BLACK;
+                    rotateLeftET(tree, x->parent);
+                    x = tree->root;
+                }
+            } else {
+                ExtNode w = x->parent->left;
+
+                if (w->colour == RED) {
+                    w->colour = BLACK;
+                    x->parent->colour = RED;
+                    rotateRightET(tree, x->parent);
+                    w = x->parent->left;
+                }
+
+                if (w->right->colour == BLACK && w->left->colour == BLACK) {
+                    w->colour = RED;
+                    x = x->parent;
+                } else {
+                    if (w->left->colour == BLACK) {
+                        w->right->colour = BLACK;
+                        w->colour = RED;
+                        rotateLeftET(tree, w);
+                        w = x->parent->left;
+                    }
+                    w->colour = x->parent->colour;
+                    x->parent->colour = BLACK;
+                    w->left->colour = BLACK;
+                    rotateRightET(tree, x->parent);
+                    x = tree->root;
+                }
+            }
+        }
+        x->colour = BLACK;
+    }
+
+    /* The sentinel's parent may have been scribbled on; reset it */
+    tree->nil.parent = &tree->nil;
+
+    tree->size--;
+    giveToPool(ET_NODES, z);
+
+    return val;
+}
+
+long extStartET(ExtNode node) {
+    return node ? node->start : -1;
+}
+
+long extEndET(ExtNode node) {
+    return node ? node->end : -1;
+}
+
+void* extValET(ExtNode node) {
+    return node ? node->val : NULL;
+}
+
+void setExtBoundsET(ExtNode node, long start, long end) {
+    if (node) {
+        node->start = start;
+        node->end = end;
+    }
+}
+
+void setExtValET(ExtNode node, void *val) {
+    if (node)
+        node->val = val;
+}
@@ -0,0 +1,87 @@
+#ifndef _EXTENTTREE_H_
+#define _EXTENTTREE_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * An ordered set of disjoint extents [start, end), kept in a red-black
+ * tree keyed on the start of each extent. Every lookup, insertion and
+ * removal takes O(log n). Each extent may carry an arbitrary value.
+ */
+struct extenttree;
+typedef struct extenttree* ExtTree;
+
+struct extnode;
+typedef struct extnode* ExtNode;
+
+ExtTree makeET();
+
+/**
+ * Frees the tree and all of its nodes. Values are not freed.
+ */
+void flushET(ExtTree);
+
+long sizeOfET(ExtTree);
+int isEmptyET(ExtTree);
+
+/**
+ * Gets the extent containing the given block, or NULL if none does.
+ */
+ExtNode findInET(ExtTree, long blk);
+
+/**
+ * Gets the last extent starting at or before blk, or NULL.
+ */
+ExtNode floorET(ExtTree, long blk);
+
+/**
+ * Gets the first extent starting at or after blk, or NULL.
+ */
+ExtNode ceilET(ExtTree, long blk);
+
+ExtNode firstET(ExtTree);
+ExtNode lastET(ExtTree);
+
+/* In-order neighbours of an extent, or NULL at either end. */
+ExtNode nextET(ExtNode);
+ExtNode prevET(ExtNode);
+
+/**
+ * Inserts the extent [start, end). The caller guarantees that it does
+ * not overlap any extent already in the tree.
+ *
+ * return - The node holding the new extent.
+ */
+ExtNode insertET(ExtTree, long start, long end, void *val);
+
+/**
+ * Removes an extent from the tree and frees its node.
+ *
+ * return - The value the extent carried.
+ */
+void* removeET(ExtTree, ExtNode);
+
+long extStartET(ExtNode);
+long extEndET(ExtNode);
+void* extValET(ExtNode);
+
+/**
+ * Moves the bounds of an extent in place. The new bounds must not
+ * overlap or reorder it with respect to its neighbours.
+ */
+void setExtBoundsET(ExtNode, long start, long end);
+void setExtValET(ExtNode, void *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,26 +1,39 @@
 #include "linkedlist.h"
+#include "pool.h"
 
 #include <stdlib.h>
 
 struct llnode {
     void *val;
     struct llnode *next;
+    struct llnode *prev;
 };
-typedef struct llnode* LLnode;
 
 struct linkedlist {
     LLnode head;
     LLnode tail;
-};
 
-struct ll_iterator {
-    LLnode curr;
+    /* The number of items, kept so that sizeOfLL is constant time */
+    int size;
 };
 
+/* Every list and item comes from these, made on first use */
+Pool LL_HEADS = NULL;
+Pool LL_NODES = NULL;
+
 
 LList makeLL() {
-    LList list = (LList) malloc(sizeof(struct linkedlist));
+    LList list;
+
+    if (!LL_HEADS) {
+        LL_HEADS = makePool("lists", sizeof(struct linkedlist));
+        LL_NODES = makePool("list items", sizeof(struct llnode));
+    }
+
+    list = (LList) takeFromPool(LL_HEADS);
     list->head = NULL;
+    list->tail = NULL;
+    list->size = 0;
     return list;
 }
 
@@ -39,43 +52,55 @@ LList cloneLL(LList l) {
 
 }
 
+void flushLL(LList l) {
+    if (!l) return;
 
-int sizeOfLL(LList l) {
-    int len = 0;
-    LLnode curr;
+    while (l->head)
+        remNodeLL(l, l->head);
 
-    if (!l) return 0; /* Empty case */
+    giveToPool(LL_HEADS, l);
+}
 
-    curr = l->head;
-    while (curr) {
-        curr = curr->next;
-        len++;
+void resetAllLL() {
+    if (LL_HEADS) {
+        resetPool(LL_HEADS);
+        resetPool(LL_NODES);
     }
+}
+
 
-    return len;
+int sizeOfLL(LList l) {
+    return l ? l->size : 0;
 }
 
 int isEmptyLL(LList l) {
     return !l || !(l->head);
 }
 
-void* getFromLL(LList l, int idx) {
+/**
+ * The item at an index, walking from whichever end is nearer.
+ */
+static LLnode nodeAtLL(LList l, int idx) {
     LLnode curr;
-    
-    /* Empty and below bounds cases */
-    if (!l || idx < 0)
+
+    if (!l || idx < 0 || idx >= l->size)
         return NULL;
-    
-    curr = l->head;
-    while (curr) {
-        if (idx == 0)
-            return curr->val;
 
-        curr = curr->next;
-        idx--;
+    if (idx < l->size / 2) {
+        for (curr = l->head; idx > 0; idx--)
+            curr = curr->next;
+    } else {
+        for (curr = l->tail, idx = l->size - 1 - idx; idx > 0; idx--)
+            curr = curr->prev;
     }
 
-    return NULL;
+    return curr;
+}
+
+void* getFromLL(LList l, int idx) {
+    LLnode node = nodeAtLL(l, idx);
+
+    return node ? node->val : NULL;
 }
 
 int indexOfLL(LList l, void *val) {
@@ -95,111 +120,131 @@ int indexOfLL(LList l, void *val) {
     return -1;
 }
 
-void appendToLL(LList l, void *val) {
-    if (!l) return;
-    
-    if (l->head == NULL) {
-        /* List is empty */
-        l->head = (LLnode) malloc(sizeof(struct llnode));
-        l->head->val = val;
-        l->head->next = NULL;
-        l->tail = l->head;
-    } else {
-        /* List is non-empty */
-        l->tail->next = (LLnode) malloc(sizeof(struct llnode));
-        l->tail = l->tail->next;
+LLnode appendToLL(LList l, void *val) {
+    if (!l) return NULL;
 
-        l->tail->val = val;
-        l->tail->next = NULL;
-    }
+    return addAfterLL(l, l->tail, val);
 }
 
 void addToLL(LList l, int idx, void *val) {
-    LLnode node;
-    
-    /* Empty cases */
+    /* Empty case */
     if (!l) return;
-    else if (l->head == NULL) {
-        appendToLL(l, val);
-        return;
-    }
-
-    node = (LLnode) malloc(sizeof(struct llnode));
-    node->val = val;
 
-    if (idx <= 0) {
+    if (idx <= 0)
         /* Front of list case */
-        node->next = l->head;
-        l->head = node;
-    } else {
-        LLnode curr = l->head;
-        while (curr->next && idx > 1) {
-            curr = curr->next; 
-            idx--;
-        }
-        
-        /* Set new tail if necessary */
-        if (curr->next == NULL)
-            l->tail = node;
-
-        node->next = curr->next;
-        curr->next = node;
-    }
+        addAfterLL(l, NULL, val);
+    else if (idx >= l->size)
+        addAfterLL(l, l->tail, val);
+    else
+        addAfterLL(l, nodeAtLL(l, idx - 1), val);
 }
 
 void* remFromLL(LList l, int idx) {
     if (!l || l->head == NULL)
         /* Empty list */
         return NULL;
-    else if (l->head->next == NULL) {
-        /* Singleton list */
-        void *res = l->head->val;
 
-        l->head->val = NULL;
-        free(l->head);
-        l->head = l->tail = NULL;
+    /* Out of range indexes take the nearest end */
+    if (idx < 0)
+        idx = 0;
+    else if (idx >= l->size)
+        idx = l->size - 1;
 
-        return res;
-    } else {
-        /* Plural items */
-        LLnode curr = l->head;
-        LLnode rem;
+    return remNodeLL(l, nodeAtLL(l, idx));
+}
 
-        void *res = NULL;
+LLnode headOfLL(LList l) {
+    return l ? l->head : NULL;
+}
 
-        while (idx > 1 && curr->next->next) {
-            curr = curr->next;
-            idx--;
-        }
-        
-        if (idx > 0) {
-            /* Item is at front of list */
-            rem = curr->next;
-            res = curr->next->val;
-
-            curr->next = curr->next->next;
-        } else {
-            rem = curr;
-            res = curr->val;
-            l->head = rem->next;
-
-            if (rem->next == NULL)
-                l->tail = curr;
-        }
+LLnode tailOfLL(LList l) {
+    return l ? l->tail : NULL;
+}
 
-        rem->val = NULL;
-        rem->next = NULL;
-        free(rem);
+LLnode nextNodeLL(LLnode node) {
+    return node ? node->next : NULL;
+}
 
-        return res;
+LLnode prevNodeLL(LLnode node) {
+    return node ? node->prev : NULL;
+}
+
+void* nodeValLL(LLnode node) {
+    return node ? node->val : NULL;
+}
+
+LLnode nodeOfLL(LList l, void *val) {
+    LLnode curr;
+
+    for (curr = l ? l->head : NULL; curr; curr = curr->next) {
+        if (curr->val == val)
+            return curr;
     }
-    
+
+    return NULL;
+}
+
+LLnode addAfterLL(LList l, LLnode node, void *val) {
+    LLnode add;
+
+    if (!l) return NULL;
+
+    add = (LLnode) takeFromPool(LL_NODES);
+    add->val = val;
+    add->prev = node;
+    add->next = node ? node->next : l->head;
+
+    /* Link in both directions, moving the ends if necessary */
+    if (add->next)
+        add->next->prev = add;
+    else
+        l->tail = add;
+
+    if (node)
+        node->next = add;
+    else
+        l->head = add;
+
+    l->size++;
+
+    return add;
+}
+
+void* remNodeLL(LList l, LLnode node) {
+    void *res;
+
+    if (!l || !node)
+        return NULL;
+
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        l->head = node->next;
+
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        l->tail = node->prev;
+
+    l->size--;
+
+    res = node->val;
+
+    node->val = NULL;
+    node->next = node->prev = NULL;
+    giveToPool(LL_NODES, node);
+
+    return res;
+}
+
+void initLLiter(LLiter iter, LList list) {
+    iter->curr = list ? list->head : NULL;
 }
 
 LLiter makeLLiter(LList list) {
     LLiter iter = (LLiter) malloc(sizeof(struct ll_iterator));
 
-    iter->curr = list ? list->head : NULL;
+    initLLiter(iter, list);
 
     return iter;
 
@@ -7,30 +7,104 @@
  * James Romph
  */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct linkedlist;
 typedef struct linkedlist* LList;
 
-struct ll_iterator;
+/**
+ * A handle on one item of a list. It stays valid until that item is
+ * removed, whatever else is added or removed around it.
+ */
+struct llnode;
+typedef struct llnode* LLnode;
+
+/**
+ * An iterator may live on the stack (see initLLiter) instead of being
+ * made with makeLLiter.
+ */
+struct ll_iterator {
+    LLnode curr;
+};
 typedef struct ll_iterator* LLiter;
 
 LList makeLL();
 LList cloneLL(LList);
 
+/**
+ * Frees the list and its items. Values are not freed.
+ */
+void flushLL(LList);
+
+/**
+ * Frees every list and item at once, without visiting them. Every
+ * list made so far becomes invalid.
+ */
+void resetAllLL();
+
+/* Constant time */
 int sizeOfLL(LList);
 int isEmptyLL(LList);
 
 void* getFromLL(LList, int idx);
 int indexOfLL(LList, void *val);
 
-void appendToLL(LList, void *val);
+/**
+ * Adds an item at the end of the list.
+ *
+ * return - The handle of the new item.
+ */
+LLnode appendToLL(LList, void *val);
 void addToLL(LList, int idx, void *val);
 
 void* remFromLL(LList l, int idx);
 
+/* Handle functions */
+
+/* The first and last items of a list, or NULL if it is empty */
+LLnode headOfLL(LList);
+LLnode tailOfLL(LList);
+
+/* The neighbours of an item, or NULL at either end */
+LLnode nextNodeLL(LLnode);
+LLnode prevNodeLL(LLnode);
+
+void* nodeValLL(LLnode);
+
+/**
+ * Finds the first item holding val.
+ *
+ * return - Its handle, or NULL if there is none.
+ */
+LLnode nodeOfLL(LList, void *val);
+
+/**
+ * Adds an item just after the one with the given handle, or at the
+ * front of the list if the handle is NULL. Constant time.
+ *
+ * return - The handle of the new item.
+ */
+LLnode addAfterLL(LList, LLnode node, void *val);
+
+/**
+ * Removes the item with the given handle, which must belong to the
+ * list. Constant time.
+ *
+ * return - The value the item held.
+ */
+void* remNodeLL(LList, LLnode node);
+
 /* Iterator functions */
+void initLLiter(LLiter, LList);
 LLiter makeLLiter(LList);
 int iterHasNextLL(LLiter);
 void* iterNextLL(LLiter);
 void disposeIterLL(LLiter);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
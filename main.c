@@ -45,6 +45,38 @@ int main(int argc, char *argv[]) {
                 i++;
             } else
                 printf("\033[1m\033[33mWarning\033[0m: Provided flag %s without value\n", argv[i]);
+        } else if (!strcmp(argv[i], "-d")) {
+            /* User defers block allocation until this many blocks are pending */
+            if (argv[i+1]) {
+                useDelayedAlloc(atol(argv[i+1]));
+                i++;
+            } else
+                printf("\033[1m\033[33mWarning\033[0m: Provided flag %s without value\n", argv[i]);
+        } else if (!strcmp(argv[i], "-a")) {
+            /* User picks the block allocator */
+            if (argv[i+1]) {
+                if (useAllocator(argv[i+1]))
+                    printf("\033[1m\033[33mWarning\033[0m: Unknown allocator %s; defaulting to %s\n", argv[i+1], allocatorName());
+                i++;
+            } else
+                printf("\033[1m\033[33mWarning\033[0m: Provided flag %s without value\n", argv[i]);
+        } else if (!strcmp(argv[i], "-m")) {
+            /* User picks how the trees' memory is released */
+            if (argv[i+1]) {
+                if (!strcmp(argv[i+1], "arena"))
+                    useArena(1);
+                else if (strcmp(argv[i+1], "pool"))
+                    printf("\033[1m\033[33mWarning\033[0m: Unknown memory mode %s; defaulting to pool\n", argv[i+1]);
+                i++;
+            } else
+                printf("\033[1m\033[33mWarning\033[0m: Provided flag %s without value\n", argv[i]);
+        } else if (!strcmp(argv[i], "-i")) {
+            /* User backs the blocks with a disk image on the host */
+            if (argv[i+1]) {
+                useDiskImage(argv[i+1]);
+                i++;
+            } else
+                printf("\033[1m\033[33mWarning\033[0m: Provided flag %s without value\n", argv[i]);
         } 
     }
 
@@ -64,9 +96,17 @@ int main(int argc, char *argv[]) {
         printf("Using filesystem size of %ldB\n", fs_size);
     }
 
+    printf("Using %s allocator\n", allocatorName());
+
+    if (delayedAllocThreshold())
+        printf("Delaying allocation until %ld blocks are pending\n", delayedAllocThreshold());
+
     /* Initialize the filesystem */
     init_filesystem(blk_size, fs_size);
 
+    if (hasDiskImage())
+        printf("Holding block data in a disk image\n");
+
 
     while (1) {
         char buff[64];
@@ -79,7 +119,7 @@ int main(int argc, char *argv[]) {
         printf("\033[1m\033[32m" "oslab@IIT(BHU)\033[0m:\033[1m\033[34m");
         
         /* Show present path */
-        arg_vec = pathVecOfTree(getWorkDirNode());
+        arg_vec = pathVecIn(getWorkRootNode(), getWorkDirNode());
         for (n = 0; arg_vec[n]; n++)
             printf("%s%s", arg_vec[n], arg_vec[n+1] ? "/" : "");
         free_str_vec(arg_vec);
@@ -0,0 +1,239 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Slabs and arena chunks are this many bytes, unless an item needs more */
+#define SLAB_BYTES 65536
+
+/* Enough for every pool and arena in the system */
+#define MAX_POOLS 16
+
+/* Everything handed out is aligned to this */
+#define ALIGN sizeof(void*)
+
+struct slab {
+    struct slab *next;
+    char items[];
+};
+
+struct pool {
+    long item_size;
+    long slab_items;
+
+    /* Every slab, in the order they are carved */
+    struct slab *slabs;
+
+    /* The slab being carved, and how many of its items are */
+    struct slab *curr;
+    long carved;
+
+    /* Given-back items, linked through their first word */
+    void *free_list;
+
+    struct poolstats stats;
+};
+
+struct chunk {
+    struct chunk *next;
+    long size;
+    char data[];
+};
+
+struct arena {
+    /* Every chunk, in the order they are filled */
+    struct chunk *chunks;
+
+    /* The chunk being filled, and how many of its bytes are */
+    struct chunk *curr;
+    long used;
+
+    struct poolstats stats;
+};
+
+/* The counts of every pool and arena, in the order they were made */
+struct poolstats *POOLS[MAX_POOLS];
+int NUM_POOLS = 0;
+
+
+static void registerPool(struct poolstats *stats, char *name) {
+    stats->name = name;
+    stats->taken = stats->live = stats->mallocs = 0;
+
+    if (NUM_POOLS < MAX_POOLS)
+        POOLS[NUM_POOLS++] = stats;
+}
+
+static void unregisterPool(struct poolstats *stats) {
+    int i;
+
+    for (i = 0; i < NUM_POOLS; i++) {
+        if (POOLS[i] == stats) {
+            memmove(&POOLS[i], &POOLS[i+1], (NUM_POOLS - i - 1) * sizeof(struct poolstats*));
+            NUM_POOLS--;
+            return;
+        }
+    }
+}
+
+static long alignUp(long bytes) {
+    return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+Pool makePool(char *name, long item_size) {
+    Pool pool = (Pool) malloc(sizeof(struct pool));
+
+    /* Free items hold the free list link */
+    pool->item_size = alignUp(item_size > (long) sizeof(void*) ? item_size : (long) sizeof(void*));
+    pool->slab_items = SLAB_BYTES / pool->item_size;
+    if (pool->slab_items < 1)
+        pool->slab_items = 1;
+
+    pool->slabs = pool->curr = NULL;
+    pool->carved = 0;
+    pool->free_list = NULL;
+
+    registerPool(&pool->stats, name);
+
+    return pool;
+}
+
+void flushPool(Pool pool) {
+    if (pool) {
+        while (pool->slabs) {
+            struct slab *next = pool->slabs->next;
+            free(pool->slabs);
+            pool->slabs = next;
+        }
+
+        unregisterPool(&pool->stats);
+        free(pool);
+    }
+}
+
+void* takeFromPool(Pool pool) {
+    void *item;
+
+    if (pool->free_list) {
+        /* Recycle the most recently given item */
+        item = pool->free_list;
+        pool->free_list = *((void**) item);
+    } else {
+        if (!pool->curr || pool->carved == pool->slab_items) {
+            /* Move on to the next slab, making one if there is none */
+            struct slab *next = pool->curr ? pool->curr->next : pool->slabs;
+
+            if (!next) {
+                next = (struct slab*) malloc(sizeof(struct slab) + pool->slab_items * pool->item_size);
+                next->next = NULL;
+                pool->stats.mallocs++;
+
+                if (pool->curr)
+                    pool->curr->next = next;
+                else
+                    pool->slabs = next;
+            }
+
+            pool->curr = next;
+            pool->carved = 0;
+        }
+
+        item = pool->curr->items + pool->carved++ * pool->item_size;
+    }
+
+    pool->stats.taken++;
+    pool->stats.live++;
+
+    return item;
+}
+
+void giveToPool(Pool pool, void *item) {
+    if (!item)
+        return;
+
+    *((void**) item) = pool->free_list;
+    pool->free_list = item;
+    pool->stats.live--;
+}
+
+void resetPool(Pool pool) {
+    pool->curr = NULL;
+    pool->carved = 0;
+    pool->free_list = NULL;
+    pool->stats.live = 0;
+}
+
+Arena makeArena(char *name) {
+    Arena arena = (Arena) malloc(sizeof(struct arena));
+
+    arena->chunks = arena->curr = NULL;
+    arena->used = 0;
+
+    registerPool(&arena->stats, name);
+
+    return arena;
+}
+
+void flushArena(Arena arena) {
+    if (arena) {
+        while (arena->chunks) {
+            struct chunk *next = arena->chunks->next;
+            free(arena->chunks);
+            arena->chunks = next;
+        }
+
+        unregisterPool(&arena->stats);
+        free(arena);
+    }
+}
+
+void* takeFromArena(Arena arena, long bytes) {
+    void *data;
+
+    bytes = alignUp(bytes > 0 ? bytes : 1);
+
+    while (!arena->curr || arena->used + bytes > arena->curr->size) {
+        struct chunk *next = arena->curr ? arena->curr->next : arena->chunks;
+
+        if (!next || next->size < bytes) {
+            /* A new chunk goes in front of any kept one too small to use */
+            long size = bytes > SLAB_BYTES ? bytes : SLAB_BYTES;
+            struct chunk *add = (struct chunk*) malloc(sizeof(struct chunk) + size);
+
+            add->size = size;
+            add->next = next;
+            arena->stats.mallocs++;
+
+            if (arena->curr)
+                arena->curr->next = add;
+            else
+                arena->chunks = add;
+            next = add;
+        }
+
+        arena->curr = next;
+        arena->used = 0;
+    }
+
+    data = arena->curr->data + arena->used;
+    arena->used += bytes;
+
+    arena->stats.taken += bytes;
+    arena->stats.live += bytes;
+
+    return data;
+}
+
+void resetArena(Arena arena) {
+    arena->curr = NULL;
+    arena->used = 0;
+    arena->stats.live = 0;
+}
+
+int poolStats(int i, struct poolstats *stats) {
+    if (i < 0 || i >= NUM_POOLS)
+        return 1;
+
+    *stats = *POOLS[i];
+    return 0;
+}
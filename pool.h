@@ -0,0 +1,86 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A slab pool of fixed-size items. Items are carved out of large
+ * slabs, and given-back items are recycled through a free list, so
+ * that taking or giving one costs no call to malloc or free. Every
+ * pool is registered under a name so that its counts can be
+ * reported.
+ */
+struct pool;
+typedef struct pool* Pool;
+
+/**
+ * Creates an empty pool of items of the given size. The name is not
+ * copied.
+ */
+Pool makePool(char *name, long item_size);
+
+/**
+ * Frees the pool and every slab it holds, including the items that
+ * are still in use.
+ */
+void flushPool(Pool);
+
+void* takeFromPool(Pool);
+void giveToPool(Pool, void *item);
+
+/**
+ * Makes every item of the pool free at once, keeping the slabs for
+ * reuse. Items still in use become invalid.
+ */
+void resetPool(Pool);
+
+/**
+ * A bump allocator for variable-sized data that is only ever freed
+ * all at once, by a reset.
+ */
+struct arena;
+typedef struct arena* Arena;
+
+Arena makeArena(char *name);
+void flushArena(Arena);
+
+void* takeFromArena(Arena, long bytes);
+void resetArena(Arena);
+
+/**
+ * Allocation counts, for reporting. Pools and arenas are listed in
+ * the order they were made.
+ */
+struct poolstats {
+    char *name;
+
+    /* Items (or bytes, for an arena) handed out since the pool was made */
+    long taken;
+
+    /* Items (or bytes) in use now */
+    long live;
+
+    /* Calls made to malloc for slabs or arena chunks */
+    long mallocs;
+};
+
+/**
+ * Fills stats with the counts of the ith pool or arena.
+ *
+ * return - Nonzero if there are not that many.
+ */
+int poolStats(int i, struct poolstats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
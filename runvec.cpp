@@ -0,0 +1,36 @@
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#include "runvec.h"
+
+#include <type_traits>
+
+/* The C struct stands in for the template, so they must match */
+static_assert(std::is_standard_layout<RunList>::value, "RunList must have a C layout");
+static_assert(sizeof(RunList) == sizeof(RunVec), "RunVec must match RunList's size");
+static_assert(alignof(RunList) == alignof(RunVec), "RunVec must match RunList's alignment");
+
+static RunList& asRunList(RunVec *runs) {
+    return *reinterpret_cast<RunList*>(runs);
+}
+
+void initRunVec(RunVec *runs) {
+    new (runs) RunList();
+}
+
+void flushRunVec(RunVec *runs) {
+    asRunList(runs).~RunList();
+}
+
+void pushRunVec(RunVec *runs, long start, long len, long offset) {
+    Extent run;
+
+    run.start = start;
+    run.len = len;
+    run.offset = offset;
+
+    asRunList(runs).push_back(run);
+}
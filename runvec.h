@@ -0,0 +1,56 @@
+#ifndef _RUNVEC_H_
+#define _RUNVEC_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+#include "dirtree.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The number of runs a RunVec holds before it needs the heap */
+#define RUNVEC_INLINE 8
+
+/**
+ * The C face of a SmallVec<Extent, RUNVEC_INLINE> (see smallvec.h),
+ * laid out the same way, so that a list either side owns can be
+ * filled by the other. The first RUNVEC_INLINE runs live inside the
+ * struct, so a list on the stack touches the heap only once it
+ * outgrows them. The fields may be read directly; a RunVec points
+ * into itself, so it must not be copied by value.
+ */
+struct runvec {
+    Extent *items;
+    size_t len;
+    size_t cap;
+    Extent store[RUNVEC_INLINE];
+};
+
+/* Starts an empty list, or disposes of one */
+void initRunVec(RunVec *runs);
+void flushRunVec(RunVec *runs);
+
+/* Appends a run to a list */
+void pushRunVec(RunVec *runs, long start, long len, long offset);
+
+#ifdef __cplusplus
+}
+
+#include "smallvec.h"
+
+typedef SmallVec<Extent, RUNVEC_INLINE> RunList;
+
+/* A list of runs as the C modules see it */
+inline RunVec* asRunVec(RunList &runs) {
+    return reinterpret_cast<RunVec*>(&runs);
+}
+#endif
+
+#endif
@@ -1,8 +1,19 @@
+#define _GNU_SOURCE
+
 #include "simsys.h"
+#include "runvec.h"
+#include "extenttree.h"
+#include "bitmap.h"
+#include "buddy.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 long BLOCK_SIZE = 0;
 long NUM_BLOCKS = 0;
@@ -10,21 +21,464 @@ long NUM_BLOCKS = 0;
 DirTree ROOT_DIR = NULL;
 DirTree WORK_DIR = NULL;
 
+/* The root of the tree holding WORK_DIR: ROOT_DIR or a snapshot */
+DirTree WORK_ROOT = NULL;
+
+/* The files with blocks reserved under delayed allocation */
+LList PENDING_FILES = NULL;
+
 /**
- * The list of allocated blocks.
- * Invariant - For any index i = 2n,
- *             i is the start of a memory
- *             block, and i+1 is the end of
- *             the same block.
+ * The set of allocated sectors, used by the extent allocator.
+ * Invariant - Every extent [a, b) in the tree is a maximal
+ *             run of allocated blocks, so no two extents
+ *             touch or overlap.
  * Logic: In memory, we suppose that we have some set
  *        of allocated sectors B_i = [a, b), where all
- *        addresses in blocks [a, b) are taken. We say
- *        that we will hold a list of these pairs, such
- *        that any two consecutive values represent either
- *        the beginning and end of sectors or the borders
- *        of consective sectors.
+ *        addresses in blocks [a, b) are taken. The sectors
+ *        are kept in a red-black tree keyed on a, so that
+ *        locating, splitting and merging a sector is O(log n).
+ */
+ExtTree MEM_ALLOC = NULL;
+
+/**
+ * The allocation map used by the bitmap allocator: bit n
+ * is set iff block n is allocated.
+ */
+Bitmap MEM_BITMAP = NULL;
+
+/* Every block below this one is allocated in MEM_BITMAP. */
+long BITMAP_HINT = 0;
+
+/**
+ * The free chunk lists used by the buddy allocator. The buddy
+ * allocator also keeps MEM_BITMAP up to date, which answers its
+ * queries about individual blocks.
+ */
+Buddy MEM_BUDDY = NULL;
+
+/**
+ * Blocks held more than once, by snapshots or clones. Each extent
+ * carries the number of references to its blocks, which is at least
+ * 2; an allocated block outside every extent has exactly one.
+ * Freeing a shared block only drops a reference.
+ */
+ExtTree SHARED = NULL;
+
+/* Reference counts are stored directly in the extents' values */
+#define REFS(sec) ((long) extValET(sec))
+#define SET_REFS(sec, n) setExtValET(sec, (void*) (long) (n))
+
+/**
+ * Read-only copies of the file tree, each under a root named
+ * "@<name>" that shares its nodes with the live tree until either
+ * side changes them. A block map, however many trees share it, holds
+ * one reference to each of its blocks.
+ */
+LList SNAPSHOTS = NULL;
+
+/**
+ * An allocator backend. Every backend answers the same
+ * questions about the disk, so the public block functions
+ * below are written once against this table.
+ */
+struct allocator {
+    char *name;
+
+    void (*init)(long blocks);
+    void (*flush)();
+
+    /* Whether a block is allocated */
+    int (*used)(long blk);
+
+    /* First free/allocated block at or after a block, or NUM_BLOCKS */
+    long (*nextFree)(long from);
+    long (*nextUsed)(long from);
+
+    /* Marks a run of free blocks allocated, or a run of allocated
+       blocks free. */
+    void (*claim)(long lo, long hi);
+    void (*release)(long lo, long hi);
+
+    /* Chooses where a run of n blocks should start, or -1 if it cannot
+       be placed. NULL means first fit. */
+    long (*pick)(long n);
+
+    /* Number of allocated blocks and of maximal allocated runs,
+       recounted from scratch (see checkAllocCounters) */
+    long (*numUsed)();
+    long (*numRuns)();
+};
+
+/* Extent tree backend */
+
+static void extentInit(long blocks) {
+    (void) blocks; /* The tree holds allocated sectors, so it starts empty */
+    MEM_ALLOC = makeET();
+}
+
+static void extentFlush() {
+    flushET(MEM_ALLOC);
+    MEM_ALLOC = NULL;
+}
+
+static int extentUsed(long blk) {
+    return findInET(MEM_ALLOC, blk) != NULL;
+}
+
+static long extentNextFree(long from) {
+    ExtNode sec = findInET(MEM_ALLOC, from);
+
+    /* Sectors are maximal, so the end of one is always free */
+    return sec ? extEndET(sec) : from;
+}
+
+static long extentNextUsed(long from) {
+    ExtNode sec = findInET(MEM_ALLOC, from);
+
+    if (sec)
+        return from;
+
+    sec = ceilET(MEM_ALLOC, from);
+    return sec ? extStartET(sec) : NUM_BLOCKS;
+}
+
+static void extentClaim(long lo, long hi) {
+    ExtNode left = lo > 0 ? findInET(MEM_ALLOC, lo - 1) : NULL;
+    ExtNode right = findInET(MEM_ALLOC, hi);
+
+    if (left && right) {
+        /* Fills the gap between two sectors: [a,lo)[lo,hi)[hi,b) ==> [a,b) */
+        long end = extEndET(right);
+        removeET(MEM_ALLOC, right);
+        setExtBoundsET(left, extStartET(left), end);
+    } else if (left) {
+        /* Extend the sector before */
+        setExtBoundsET(left, extStartET(left), hi);
+    } else if (right) {
+        /* Extend the sector after */
+        setExtBoundsET(right, lo, extEndET(right));
+    } else {
+        /* Memory in non-bordering space */
+        insertET(MEM_ALLOC, lo, hi, NULL);
+    }
+}
+
+static void extentRelease(long lo, long hi) {
+    ExtNode sec = findInET(MEM_ALLOC, lo);
+    long a, b;
+
+    if (!sec)
+        return;
+
+    a = extStartET(sec);
+    b = extEndET(sec);
+
+    if (a == lo && b == hi) {
+        /* The whole sector is freed */
+        removeET(MEM_ALLOC, sec);
+    } else if (a == lo) {
+        /* The run is at the front of the sector */
+        setExtBoundsET(sec, hi, b);
+    } else if (b == hi) {
+        /* The run is at the back of the sector */
+        setExtBoundsET(sec, a, lo);
+    } else {
+        /* In any other case, the free will split the sector in two. */
+        /* [a,b) ==> [a,lo)x[hi,b) */
+        setExtBoundsET(sec, a, lo);
+        insertET(MEM_ALLOC, hi, b, NULL);
+    }
+}
+
+static long extentNumUsed() {
+    long amt = 0;
+    ExtNode sec;
+
+    for (sec = firstET(MEM_ALLOC); sec; sec = nextET(sec))
+        amt += extEndET(sec) - extStartET(sec);
+
+    return amt;
+}
+
+static long extentNumRuns() {
+    return sizeOfET(MEM_ALLOC);
+}
+
+/* Bitmap backend */
+
+static void bitmapInit(long blocks) {
+    MEM_BITMAP = makeBM(blocks);
+    BITMAP_HINT = 0;
+}
+
+static void bitmapFlush() {
+    flushBM(MEM_BITMAP);
+    MEM_BITMAP = NULL;
+}
+
+static int bitmapUsed(long blk) {
+    return testBM(MEM_BITMAP, blk);
+}
+
+static long bitmapNextFree(long from) {
+    /* The full prefix of the disk never needs rescanning */
+    return nextClearBM(MEM_BITMAP, from < BITMAP_HINT ? BITMAP_HINT : from);
+}
+
+static long bitmapNextUsed(long from) {
+    return nextSetBM(MEM_BITMAP, from);
+}
+
+static void bitmapClaim(long lo, long hi) {
+    setRangeBM(MEM_BITMAP, lo, hi);
+
+    if (lo <= BITMAP_HINT && BITMAP_HINT < hi)
+        BITMAP_HINT = hi;
+}
+
+static void bitmapRelease(long lo, long hi) {
+    clearRangeBM(MEM_BITMAP, lo, hi);
+
+    if (lo < BITMAP_HINT)
+        BITMAP_HINT = lo;
+}
+
+static long bitmapNumUsed() {
+    return countSetBM(MEM_BITMAP);
+}
+
+static long bitmapNumRuns() {
+    return countRunsBM(MEM_BITMAP);
+}
+
+/* Buddy backend */
+
+static void buddyInit(long blocks) {
+    bitmapInit(blocks);
+    MEM_BUDDY = makeBuddy(blocks);
+}
+
+static void buddyFlush() {
+    bitmapFlush();
+    flushBuddy(MEM_BUDDY);
+    MEM_BUDDY = NULL;
+}
+
+static void buddyClaim(long lo, long hi) {
+    bitmapClaim(lo, hi);
+    carveBuddy(MEM_BUDDY, lo, hi);
+}
+
+static void buddyRelease(long lo, long hi) {
+    bitmapRelease(lo, hi);
+    freeBuddy(MEM_BUDDY, lo, hi);
+}
+
+static long buddyPick(long n) {
+    /* Carve from the smallest chunk that holds the request */
+    return pickBuddy(MEM_BUDDY, orderForBuddy(n));
+}
+
+struct allocator ALLOCATORS[] = {
+    { "extent", extentInit, extentFlush, extentUsed, extentNextFree, extentNextUsed,
+      extentClaim, extentRelease, NULL, extentNumUsed, extentNumRuns },
+    { "bitmap", bitmapInit, bitmapFlush, bitmapUsed, bitmapNextFree, bitmapNextUsed,
+      bitmapClaim, bitmapRelease, NULL, bitmapNumUsed, bitmapNumRuns },
+    { "buddy", buddyInit, buddyFlush, bitmapUsed, bitmapNextFree, bitmapNextUsed,
+      buddyClaim, buddyRelease, buddyPick, bitmapNumUsed, bitmapNumRuns },
+    { NULL }
+};
+
+/* The allocator in use; the extent tree by default. */
+struct allocator *ALLOC = &ALLOCATORS[0];
+
+/**
+ * Delayed allocation. When DELAY_THRESHOLD is nonzero, growing a
+ * file only reserves capacity; its blocks are allocated together
+ * once it has DELAY_THRESHOLD reserved, or on sync.
+ * RESERVED_BLOCKS is the capacity promised to files this way.
+ */
+long DELAY_THRESHOLD = 0;
+long RESERVED_BLOCKS = 0;
+
+/**
+ * spreadGoal compares at most SPREAD_SAMPLE free runs per call. Each
+ * call starts where the last one stopped, at SPREAD_CURSOR, so that
+ * successive new files sample the whole disk between them.
+ */
+#define SPREAD_SAMPLE 16
+long SPREAD_CURSOR = 0;
+
+/**
+ * Where a defrag pass resumes: the DEFRAG_INDEX'th file in walk
+ * order, which was DEFRAG_FILE, at logical block DEFRAG_OFFSET, which
+ * belongs at disk block DEFRAG_POS. Blocks before DEFRAG_POS are in
+ * place as long as DISK_CHANGES is still DEFRAG_STAMP. DEFRAG_FILE is
+ * NULL when no pass is under way.
+ */
+DirTree DEFRAG_FILE = NULL;
+long DEFRAG_INDEX = 0;
+long DEFRAG_OFFSET = 0;
+long DEFRAG_POS = 0;
+long DEFRAG_STAMP = 0;
+
+/**
+ * In arena mode, the trees' names and block maps come from an arena,
+ * and flush_filesystem releases the trees in one reset instead of
+ * visiting every node.
+ */
+int ARENA_MODE = 0;
+
+/**
+ * Running totals for the disk, kept up to date by claimRun and
+ * releaseRun so that capacity queries are constant time, and a count
+ * of the runs they have changed.
+ */
+long USED_BLOCKS = 0;
+long NUM_SECTORS = 0;
+long DISK_CHANGES = 0;
+
+/**
+ * The optional disk image holding the blocks' data, mapped into
+ * memory so that block blk starts at IMAGE + blk * BLOCK_SIZE.
+ * IMAGE is NULL when no image is in use.
+ */
+char *IMAGE_PATH = NULL;
+char *IMAGE = NULL;
+int IMAGE_FD = -1;
+
+static int isUsed(long blk) {
+    return blk >= 0 && blk < NUM_BLOCKS && ALLOC->used(blk);
+}
+
+/**
+ * Marks the free run [lo, hi) allocated and updates the totals.
+ */
+static void claimRun(long lo, long hi) {
+    /* The run becomes a sector of its own unless it touches others */
+    NUM_SECTORS += 1 - isUsed(lo - 1) - isUsed(hi);
+    USED_BLOCKS += hi - lo;
+    DISK_CHANGES++;
+
+    ALLOC->claim(lo, hi);
+
+    /* New blocks read back as zeroes, not as an old file's data */
+    if (IMAGE)
+        memset(IMAGE + lo * BLOCK_SIZE, 0, (hi - lo) * BLOCK_SIZE);
+
+#ifdef ALLOC_DEBUG
+    checkAllocCounters();
+#endif
+}
+
+/**
+ * Marks the allocated run [lo, hi) free and updates the totals.
+ */
+static void releaseRun(long lo, long hi) {
+    /* Freeing the middle of a sector splits it in two */
+    NUM_SECTORS += isUsed(lo - 1) + isUsed(hi) - 1;
+    USED_BLOCKS -= hi - lo;
+    DISK_CHANGES++;
+
+    ALLOC->release(lo, hi);
+
+#ifdef ALLOC_DEBUG
+    checkAllocCounters();
+#endif
+}
+
+int checkAllocCounters() {
+    long used = ALLOC->numUsed();
+    long sectors = ALLOC->numRuns();
+
+    if (used == USED_BLOCKS && sectors == NUM_SECTORS)
+        return 0;
+
+    printf("\033[1m\033[31mERROR\033[0m: Allocator counters out of sync: "
+           "%ld blocks in %ld sectors counted, %ld blocks in %ld sectors recorded\n",
+           used, sectors, USED_BLOCKS, NUM_SECTORS);
+    return 1;
+}
+
+int useAllocator(char *name) {
+    int i;
+
+    /* The backend cannot change under a live filesystem */
+    if (ROOT_DIR)
+        return 1;
+
+    for (i = 0; ALLOCATORS[i].name; i++) {
+        if (!strcmp(ALLOCATORS[i].name, name)) {
+            ALLOC = &ALLOCATORS[i];
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+char* allocatorName() {
+    return ALLOC->name;
+}
+
+int useArena(int on) {
+    /* The trees' memory cannot change under a live filesystem */
+    if (ROOT_DIR)
+        return 1;
+
+    ARENA_MODE = on;
+    return 0;
+}
+
+int useDiskImage(char *path) {
+    /* The image is mapped when the filesystem is initialized */
+    if (ROOT_DIR)
+        return 1;
+
+    IMAGE_PATH = path;
+    return 0;
+}
+
+int hasDiskImage() {
+    return IMAGE != NULL;
+}
+
+/**
+ * Opens and maps the disk image, sized to hold every block.
  */
-LList MEM_ALLOC;
+static void mapDiskImage() {
+    long bytes = NUM_BLOCKS * BLOCK_SIZE;
+    void *map;
+
+    if (!IMAGE_PATH || bytes <= 0)
+        return;
+
+    IMAGE_FD = open(IMAGE_PATH, O_RDWR | O_CREAT, 0644);
+    if (IMAGE_FD < 0) {
+        printf("\033[1m\033[31mERROR\033[0m: Cannot open disk image %s\n", IMAGE_PATH);
+        return;
+    }
+
+    if (ftruncate(IMAGE_FD, bytes)
+        || (map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, IMAGE_FD, 0)) == MAP_FAILED) {
+        printf("\033[1m\033[31mERROR\033[0m: Cannot map disk image %s\n", IMAGE_PATH);
+        close(IMAGE_FD);
+        IMAGE_FD = -1;
+        return;
+    }
+
+    IMAGE = (char*) map;
+}
+
+static void unmapDiskImage() {
+    if (IMAGE)
+        munmap(IMAGE, NUM_BLOCKS * BLOCK_SIZE);
+    if (IMAGE_FD >= 0)
+        close(IMAGE_FD);
+
+    IMAGE = NULL;
+    IMAGE_FD = -1;
+}
 
 void init_filesystem(long blk_size, long size) {
     
@@ -39,27 +493,65 @@ void init_filesystem(long blk_size, long size) {
     NUM_BLOCKS = size / blk_size;
     
     /* The root node of the filesystem. */
+    useTreeArena(ARENA_MODE);
     ROOT_DIR = makeDirTree("", 0);
     
     /* The initial working directory is root by default. */
     WORK_DIR = ROOT_DIR;
+    WORK_ROOT = ROOT_DIR;
     
-    /* The list of memory allocations. */
-    MEM_ALLOC = makeLL();
+    /* The record of memory allocations, and of who holds each block. */
+    ALLOC->init(NUM_BLOCKS);
+    initBlockOwners(NUM_BLOCKS);
+    SHARED = makeET();
+    SNAPSHOTS = makeLL();
+    PENDING_FILES = makeLL();
+    USED_BLOCKS = 0;
+    NUM_SECTORS = 0;
+
+    mapDiskImage();
 }
 
 void flush_filesystem() {
     
     WORK_DIR = NULL;
+    WORK_ROOT = NULL;
+
+    if (ARENA_MODE) {
+        /* Every tree, and every list they hold, goes in one reset */
+        resetDirTrees();
+        resetAllLL();
+    } else {
+        /* Recursively destroy the file tree */
+        flushDirTree(ROOT_DIR);
+
+        while (!isEmptyLL(SNAPSHOTS))
+            flushDirTree((DirTree) remFromLL(SNAPSHOTS, 0));
+        flushLL(SNAPSHOTS);
+        flushLL(PENDING_FILES);
+    }
+
+    ROOT_DIR = NULL;
+    SNAPSHOTS = NULL;
+    PENDING_FILES = NULL;
 
-    /* Recursively destroy the file tree */
-    flushDirTree(ROOT_DIR);
+    flushBlockOwners();
+    flushET(SHARED);
+    SHARED = NULL;
     
     /* Dispose of memory allocation */
-    while(!isEmptyLL(MEM_ALLOC))
-        free(remFromLL(MEM_ALLOC, 0));
-    free(MEM_ALLOC);
-    MEM_ALLOC = NULL;
+    ALLOC->flush();
+    USED_BLOCKS = 0;
+    NUM_SECTORS = 0;
+    RESERVED_BLOCKS = 0;
+    SPREAD_CURSOR = 0;
+    DEFRAG_FILE = NULL;
+    DEFRAG_INDEX = 0;
+    DEFRAG_OFFSET = 0;
+    DEFRAG_POS = 0;
+    DISK_CHANGES = 0;
+
+    unmapDiskImage();
 
     BLOCK_SIZE = 0;
     NUM_BLOCKS = 0;
@@ -74,7 +566,12 @@ DirTree getWorkDirNode() {
     return WORK_DIR;
 }
 
-void setWorkDirNode(DirTree node) {
+DirTree getWorkRootNode() {
+    return WORK_ROOT;
+}
+
+void setWorkDirNode(DirTree root, DirTree node) {
+    WORK_ROOT = root;
     WORK_DIR = node;
 }
 
@@ -87,191 +584,1134 @@ long numBlocks() {
 }
 
 long numSectors() {
-    return sizeOfLL(MEM_ALLOC) / 2;
+    return NUM_SECTORS;
 }
 
-void freeBlock(long blk) {
-    int sectors = sizeOfLL(MEM_ALLOC);
-    long lo, hi;
-    int i;
-    
-    /* End result: The ith block contains block blk. */
-    for (i = 0; i < sectors; i++) {
-        /* If block i contains blk, it must be freed from the block. */
-        if (   *((long*) getFromLL(MEM_ALLOC, 2*i)) <= blk
-            && *((long*) getFromLL(MEM_ALLOC, 2*i+1)) > blk)
-                break;
+/* Makes sure that no shared extent straddles blk */
+static void splitShared(long blk) {
+    ExtNode sec = findInET(SHARED, blk);
+
+    if (sec && extStartET(sec) < blk) {
+        long end = extEndET(sec);
+
+        setExtBoundsET(sec, extStartET(sec), blk);
+        insertET(SHARED, blk, end, extValET(sec));
     }
+}
 
-    if (i == sectors)
-        return;
-    
-    lo = *((long*) getFromLL(MEM_ALLOC, 2*i));
-    hi = *((long*) getFromLL(MEM_ALLOC, 2*i+1));
-    
-    if (lo == hi-1) {
-        /* The sector is of size 1, so free the whole sector */
-        free(remFromLL(MEM_ALLOC, 2*i));
-        free(remFromLL(MEM_ALLOC, 2*i));
-    } else if (lo == blk) {
-        /* The block is at the front of the sector */
-        *((long*) getFromLL(MEM_ALLOC, 2*i)) += 1;
-    } else if (hi-1 == blk) {
-        /* The block is at the back of the sector */
-        *((long*) getFromLL(MEM_ALLOC, 2*i+1)) -= 1;
-    } else {
-        /* IN any other case, the free will split the block in two. */
+/* Rejoins touching shared extents with equal counts around [lo, hi) */
+static void mergeShared(long lo, long hi) {
+    ExtNode sec = floorET(SHARED, lo > 0 ? lo - 1 : 0);
 
-        /* The new bounds are computed (mLo and mHi represent the freed block) */
-        long *mLo = (long*) malloc(sizeof(long));
-        long *mHi = (long*) malloc(sizeof(long));
+    if (!sec)
+        sec = firstET(SHARED);
 
-        *mLo = blk;
-        *mHi = blk+1;
-        
-        /* Create a one block gap in the memory by inserting the pair */
-        /* [a,b)...[c,d)...[e,f)... ==> [a,b)...[c,mLo)x[mHi, d)... */
-        addToLL(MEM_ALLOC, 2*i+1, mLo);
-        addToLL(MEM_ALLOC, 2*i+2, mHi);
-    }
+    while (sec && extStartET(sec) <= hi) {
+        ExtNode next = nextET(sec);
+
+        if (next && extEndET(sec) == extStartET(next) && REFS(sec) == REFS(next)) {
+            long end = extEndET(next);
 
+            removeET(SHARED, next);
+            setExtBoundsET(sec, extStartET(sec), end);
+        } else
+            sec = next;
+    }
 }
 
-long allocBlock() {
-    
-    /* The number of sectors */
-    long sectors = sizeOfLL(MEM_ALLOC) / 2;
-    long *tmp;
-
-    if (sectors == 0) {
-        /* No memory allocated */
-
-        /* We add the two bounds of the block to allocate. */
-        tmp = (long*) malloc(sizeof(long));
-        *tmp = 0;
-        addToLL(MEM_ALLOC, 0, tmp);
-        
-        tmp = (long*) malloc(sizeof(long));
-        *tmp = 1;
-        addToLL(MEM_ALLOC, 1, tmp);
+/* Adds a reference to every block of the allocated run [lo, hi) */
+static void shareRun(long lo, long hi) {
+    ExtNode sec;
+    long p = lo;
 
-        return 0;
-        
-    } else {
-        /* The bounds of the memory available */
-        long min_free = 0;
-        long max_free = *((long*) getFromLL(MEM_ALLOC, 0));
-        
-        if (min_free == max_free) {
-            /* Can't place in front, 0 bytes at the front */
-
-            /* The new minimum is the end of the first alloc'd sector */
-            min_free = *((long*) getFromLL(MEM_ALLOC, 1));
-
-            /* The end of the free sector is either the start of the next
-               sector or the end of memory */
-            max_free = sectors == 1
-                                  ? NUM_BLOCKS
-                                  : *((long*) getFromLL(MEM_ALLOC, 2));
-            
-            if (min_free == max_free) {
-                /* No available memory */
-                return -1;
-            } else if (min_free == max_free - 1) {
-                /* Closes a one-byte gap in memory (only one byte between) */
-                free(remFromLL(MEM_ALLOC, 1));
-                free(remFromLL(MEM_ALLOC, 1));
-            } else {
-                *((long*) getFromLL(MEM_ALLOC, 1)) += 1;
-            }
-            
-            /* The first free block was alloc'd */
-            return min_free;
+    splitShared(lo);
+    splitShared(hi);
 
-        } else if (min_free == max_free - 1) {
-            /* Close a one-block frag in the front */
-            *((long*) getFromLL(MEM_ALLOC, 0)) = 0;
+    for (sec = ceilET(SHARED, lo); p < hi; ) {
+        if (sec && extStartET(sec) < hi) {
+            /* Blocks before the extent had one reference */
+            if (p < extStartET(sec))
+                insertET(SHARED, p, extStartET(sec), (void*) 2L);
 
-            return 0;
+            SET_REFS(sec, REFS(sec) + 1);
+            p = extEndET(sec);
+            sec = nextET(sec);
         } else {
-            /* Memory in non-bordering space */
-            tmp = (long*) malloc(sizeof(long));
-            *tmp = 0;
-            addToLL(MEM_ALLOC, 0, tmp);
-            
-            tmp = (long*) malloc(sizeof(long));
-            *tmp = 1;
-            addToLL(MEM_ALLOC, 1, tmp);
-
-            return 0;
+            insertET(SHARED, p, hi, (void*) 2L);
+            p = hi;
         }
+    }
+
+    mergeShared(lo, hi);
+}
 
+/* Releases the allocated parts of [lo, hi) */
+static void releaseUsed(long lo, long hi) {
+    long blk;
 
-    }
+    for (blk = ALLOC->nextUsed(lo); blk < hi; blk = ALLOC->nextUsed(blk)) {
+        long end = ALLOC->nextFree(blk);
 
+        if (end > hi)
+            end = hi;
+
+        releaseRun(blk, end);
+        blk = end;
+    }
 }
 
-int enoughMemFor(long amt) {
-    int secs = sizeOfLL(MEM_ALLOC) / 2;
-    long avail = 0;
-    int i;
+/**
+ * Drops a reference to every allocated block in [lo, hi). Blocks
+ * whose last reference goes are released to the allocator.
+ */
+static void dropRun(long lo, long hi) {
+    ExtNode sec;
+    long p = lo;
 
-    /* If memory is empty, the answer is simple. */
-    if (secs == 0)
-        return NUM_BLOCKS >= amt;
-    
-    /* The amount of memory is equal to the total amount
-       of memory between each block of allocated memory. */
-    avail = *((long*) getFromLL(MEM_ALLOC, 0));
-    for (i = 1; i < secs && avail < amt; i++) {
-        avail += *((long*) getFromLL(MEM_ALLOC, 2*i-1))
-                 - *((long*) getFromLL(MEM_ALLOC, 2*i));
+    splitShared(lo);
+    splitShared(hi);
+
+    for (sec = ceilET(SHARED, lo); p < hi; ) {
+        long gap = sec && extStartET(sec) < hi ? extStartET(sec) : hi;
+
+        if (p < gap)
+            releaseUsed(p, gap);
+
+        if (gap < hi) {
+            ExtNode next = nextET(sec);
+
+            p = extEndET(sec);
+            if (REFS(sec) > 2)
+                SET_REFS(sec, REFS(sec) - 1);
+            else
+                removeET(SHARED, sec);
+            sec = next;
+        } else
+            p = hi;
     }
-    
-    /* If all gaps were viewed, tack the end onto the total */
-    if (i == secs)
-        avail += NUM_BLOCKS - *((long*) getFromLL(MEM_ALLOC, 2*secs-1));
-    
-    /* Answer the question */
-    return amt <= avail;
 
+    mergeShared(lo, hi);
 }
 
-LList getAllocData() {
-    return cloneLL(MEM_ALLOC);
+void freeBlock(long blk) {
+    /* Only allocated blocks can be freed */
+    if (!isUsed(blk))
+        return;
+
+    dropRun(blk, blk + 1);
 }
 
-long blocksAllocated() {
-    long amt = 0;
+void freeBlocks(Extent *runs, long n) {
+    long i = 0;
 
-    LLiter iter = makeLLiter(MEM_ALLOC);
-    while (iterHasNextLL(iter))
-        amt -= (*((long*) iterNextLL(iter)) - *((long*) iterNextLL(iter)));
-    
-    return amt;
-}
+    while (i < n) {
+        long lo = runs[i].start;
+        long hi = lo + runs[i].len;
 
-long nextBlock() {
-    if (isEmptyLL(MEM_ALLOC))
-        return 0;
-    else if (*((long*) getFromLL(MEM_ALLOC, 0)))
-        return 0;
-    else
-        return *((long*) getFromLL(MEM_ALLOC, 1));
+        /* Runs that touch are released together */
+        for (i++; i < n && runs[i].start <= hi; i++) {
+            if (runs[i].start + runs[i].len > hi)
+                hi = runs[i].start + runs[i].len;
+        }
+
+        if (lo < 0)
+            lo = 0;
+        if (hi > NUM_BLOCKS)
+            hi = NUM_BLOCKS;
+
+        /* Only the allocated parts of the span are released */
+        if (lo < hi)
+            dropRun(lo, hi);
+    }
 }
 
-DirTree getRelTree(DirTree tree, char **path) {
-    if (!path)
-        return getRootNode();
-    else if (!path[0])
-        return getWorkDirNode();
-    else if (strcmp(path[0], ""))
-        return getDirSubtree(tree, path);
-    else
-        return getDirSubtree(getRootNode(), &path[1]);
+void shareBlocks(Extent *runs, long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        long lo = runs[i].start < 0 ? 0 : runs[i].start;
+        long hi = runs[i].start + runs[i].len;
+        long blk;
+
+        if (hi > NUM_BLOCKS)
+            hi = NUM_BLOCKS;
+
+        /* Free blocks cannot be shared */
+        for (blk = ALLOC->nextUsed(lo); blk < hi; blk = ALLOC->nextUsed(blk)) {
+            long end = ALLOC->nextFree(blk);
+
+            if (end > hi)
+                end = hi;
+
+            shareRun(blk, end);
+            blk = end;
+        }
+    }
 }
 
+long blockRefs(long blk) {
+    ExtNode sec;
+
+    if (!isUsed(blk))
+        return 0;
 
+    sec = findInET(SHARED, blk);
+    return sec ? REFS(sec) : 1;
+}
 
+long sharedBlocks() {
+    long amt = 0;
+    ExtNode sec;
 
+    for (sec = firstET(SHARED); sec; sec = nextET(sec))
+        amt += extEndET(sec) - extStartET(sec);
 
+    return amt;
+}
+
+long refRunEnd(long lo, long hi) {
+    ExtNode sec;
+    long end;
+
+    if (hi > NUM_BLOCKS)
+        hi = NUM_BLOCKS;
+    if (lo < 0 || lo >= hi)
+        return lo;
+
+    if (!isUsed(lo)) {
+        /* Free blocks, up to the next allocated one */
+        end = ALLOC->nextUsed(lo);
+    } else if ((sec = findInET(SHARED, lo))) {
+        /* Touching shared extents with equal counts are always merged */
+        end = extEndET(sec);
+    } else {
+        /* Held once, up to the next shared extent or free block */
+        sec = ceilET(SHARED, lo);
+        end = ALLOC->nextFree(lo);
+        if (sec && extStartET(sec) < end)
+            end = extStartET(sec);
+    }
+
+    return end < hi ? end : hi;
+}
+
+/**
+ * Finds the start of a free run of at least n blocks, following the
+ * allocator's placement policy (first fit unless it has its own).
+ *
+ * return - The first block of the run, or -1 if there is none.
+ */
+static long placeRun(long n) {
+    long lo;
+
+    if (ALLOC->pick)
+        return ALLOC->pick(n);
+
+    if (n <= 1) {
+        /* Any free block will do */
+        lo = ALLOC->nextFree(0);
+        return lo < NUM_BLOCKS ? lo : -1;
+    }
+
+    for (lo = ALLOC->nextFree(0); lo < NUM_BLOCKS; lo = ALLOC->nextFree(lo)) {
+        long hi = ALLOC->nextUsed(lo);
+
+        if (hi - lo >= n)
+            return lo;
+
+        lo = hi;
+    }
+
+    return -1;
+}
+
+long allocBlock() {
+    
+    /* The lowest free block is taken, unless the allocator says otherwise */
+    long blk = placeRun(1);
+
+    if (blk < 0) {
+        /* No available memory */
+        return -1;
+    }
+
+    claimRun(blk, blk + 1);
+
+    return blk;
+
+}
+
+long allocBlocks(long n, RunVec *runs) {
+    return allocBlocksNear(n, 0, runs);
+}
+
+long allocBlocksNear(long n, long goal, RunVec *runs) {
+    size_t first = runs->len;
+    long got = 0;
+    long blk = goal > 0 && goal < NUM_BLOCKS ? goal : 0;
+
+    if (n < 0 || !enoughMemFor(n))
+        return -1;
+
+    /* Take each free run in turn until the request is satisfied */
+    while (n > 0) {
+        long lo, hi;
+
+        if (ALLOC->pick) {
+            /* Largest power of two chunk that the allocator can place */
+            long len = 1L << orderForBuddy(n);
+
+            if (len > n)
+                len >>= 1;
+            while ((lo = ALLOC->pick(len)) < 0)
+                len >>= 1;
+
+            hi = lo + len;
+        } else {
+            lo = ALLOC->nextFree(blk);
+
+            /* Wrap around once the end of the disk is reached */
+            if (lo >= NUM_BLOCKS)
+                lo = ALLOC->nextFree(0);
+
+            hi = ALLOC->nextUsed(lo);
+
+            if (hi - lo > n)
+                hi = lo + n;
+        }
+
+        claimRun(lo, hi);
+
+        if (runs->len > first && runs->items[runs->len-1].start + runs->items[runs->len-1].len == lo) {
+            /* Continues the previous run */
+            runs->items[runs->len-1].len += hi - lo;
+        } else {
+            pushRunVec(runs, lo, hi - lo, got);
+        }
+
+        got += hi - lo;
+        n -= hi - lo;
+        blk = hi;
+    }
+
+    return runs->len - first;
+}
+
+long allocBlockNear(long goal) {
+    long blk;
+
+    if (ALLOC->pick || goal <= 0 || goal >= NUM_BLOCKS)
+        return allocBlock();
+
+    /* The goal itself, or the next free block after it */
+    blk = ALLOC->nextFree(goal);
+    if (blk >= NUM_BLOCKS)
+        return allocBlock();
+
+    claimRun(blk, blk + 1);
+
+    return blk;
+}
+
+long spreadGoal() {
+    long from = SPREAD_CURSOR < NUM_BLOCKS ? SPREAD_CURSOR : 0;
+    long blk = ALLOC->nextFree(from);
+    long best = 0, bestLen = 0;
+    int seen = 0, wrapped = 0;
+
+    /* Find the largest of the next few free runs, wrapping around once */
+    while (seen < SPREAD_SAMPLE) {
+        long end;
+
+        if (blk >= NUM_BLOCKS) {
+            if (wrapped || !from)
+                break;
+            wrapped = 1;
+            blk = ALLOC->nextFree(0);
+            continue;
+        } else if (wrapped && blk >= from) {
+            break;
+        }
+
+        end = ALLOC->nextUsed(blk);
+        if (end - blk > bestLen) {
+            best = blk;
+            bestLen = end - blk;
+        }
+
+        seen++;
+        blk = ALLOC->nextFree(end);
+    }
+
+    SPREAD_CURSOR = blk;
+
+    /* If a file ends just before the run, leave it half the run to grow into */
+    if (isUsed(best - 1))
+        best += bestLen / 2;
+
+    return best;
+}
+
+long allocBlockOrder(int k) {
+    long len = 1L << k;
+    long blk = k >= 0 && len <= NUM_BLOCKS ? placeRun(len) : -1;
+
+    if (blk < 0)
+        return -1;
+
+    claimRun(blk, blk + len);
+
+    return blk;
+}
+
+int enoughMemFor(long amt) {
+    return amt <= NUM_BLOCKS - USED_BLOCKS - RESERVED_BLOCKS;
+}
+
+long getAllocData(long **bounds) {
+    long cap = 8, n = 0;
+    long *data = (long*) malloc(2 * cap * sizeof(long));
+    long lo = ALLOC->nextUsed(0);
+
+    /* Flatten the sectors into the bound pairs [a, b) */
+    while (lo < NUM_BLOCKS) {
+        if (n == cap) {
+            cap *= 2;
+            data = (long*) realloc(data, 2 * cap * sizeof(long));
+        }
+
+        data[2*n] = lo;
+        data[2*n+1] = ALLOC->nextFree(lo);
+
+        lo = ALLOC->nextUsed(data[2*n+1]);
+        n++;
+    }
+
+    *bounds = data;
+    return n;
+}
+
+long blocksAllocated() {
+    return USED_BLOCKS;
+}
+
+long blocksFree() {
+    return NUM_BLOCKS - USED_BLOCKS;
+}
+
+long blocksReserved() {
+    return RESERVED_BLOCKS;
+}
+
+long nextUsedBlock(long from) {
+    if (from < 0)
+        from = 0;
+    return from < NUM_BLOCKS ? ALLOC->nextUsed(from) : NUM_BLOCKS;
+}
+
+long nextFreeBlock(long from) {
+    if (from < 0)
+        from = 0;
+    return from < NUM_BLOCKS ? ALLOC->nextFree(from) : NUM_BLOCKS;
+}
+
+long nextBlock() {
+    long blk = placeRun(1);
+
+    return blk < 0 ? NUM_BLOCKS : blk;
+}
+
+void useDelayedAlloc(long threshold) {
+    DELAY_THRESHOLD = threshold > 0 ? threshold : 0;
+}
+
+long delayedAllocThreshold() {
+    return DELAY_THRESHOLD;
+}
+
+/* Copies a block's data in the disk image, if there is one */
+static void copyBlockData(long from, long to) {
+    if (IMAGE)
+        memcpy(IMAGE + to * BLOCK_SIZE, IMAGE + from * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+/* The number of blocks a file of the given size spans */
+static long blocksForSize(long size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Allocates n blocks for a file at logical offset onwards, near the
+ * block before them (or the file's last block) when there is one.
+ */
+static int allocFileBlocks(DirTree file, long offset, long n) {
+    long end;
+    long prev = offset > 0 ? mapMemoryOffset(file, offset - 1, &end) : -1;
+    long tail = lastMemoryBlock(file);
+    RunVec runs;
+    long nruns, i;
+
+    /* Most requests fit in a few runs, which need no heap */
+    initRunVec(&runs);
+
+    if (prev >= 0)
+        nruns = allocBlocksNear(n, prev + 1, &runs);
+    else
+        nruns = allocBlocksNear(n, tail >= 0 ? tail + 1 : spreadGoal(), &runs);
+
+    for (i = 0; i < nruns; i++)
+        assignMemoryRunAt(file, offset + runs.items[i].offset, runs.items[i].start, runs.items[i].len);
+    flushRunVec(&runs);
+
+    return nruns < 0;
+}
+
+/**
+ * Sets the number of blocks reserved for a file, keeping the list of
+ * files with reservations up to date.
+ */
+static void setReserved(DirTree file, long n) {
+    long had = getDelayedBlocks(file);
+
+    setDelayedBlocks(file, n);
+
+    /* The file keeps its item, so leaving the list costs O(1) */
+    if (!had && n) {
+        setPendingItem(file, appendToLL(PENDING_FILES, file));
+    } else if (had && !n) {
+        remNodeLL(PENDING_FILES, getPendingItem(file));
+        setPendingItem(file, NULL);
+    }
+}
+
+/**
+ * Allocates a file's delayed blocks, which are the last ones before
+ * logical block end.
+ */
+static long flushDelayedBlocks(DirTree file, long end) {
+    long n = getDelayedBlocks(file);
+
+    if (!n)
+        return 0;
+
+    /* Turn the reservation into real blocks in one batch */
+    RESERVED_BLOCKS -= n;
+    setReserved(file, 0);
+    allocFileBlocks(file, end - n, n);
+
+    return n;
+}
+
+/**
+ * The number of blocks mapped from logical block end onwards before
+ * the first hole, which are the ones preallocated past a file's size.
+ */
+static long preallocRun(DirTree file, long end) {
+    long off = end, next;
+
+    while (mapMemoryOffset(file, off, &next) >= 0)
+        off = next;
+
+    return off - end;
+}
+
+int growFile(DirTree file, long n) {
+    long end, have;
+
+    if (!file || !isTreeFile(file) || n < 0)
+        return 1;
+
+    /* The new blocks go after the file's current size */
+    end = blocksForSize(treeFileSize(file, NULL));
+
+    /* Preallocated blocks are used up before anything new is allocated */
+    have = preallocRun(file, end);
+    if (have > n)
+        have = n;
+    end += have;
+    n -= have;
+
+    if (!n)
+        return 0;
+
+    if (!DELAY_THRESHOLD)
+        return allocFileBlocks(file, end, n);
+
+    /* Only promise the capacity for now */
+    if (!enoughMemFor(n))
+        return 1;
+
+    RESERVED_BLOCKS += n;
+    setReserved(file, getDelayedBlocks(file) + n);
+
+    if (getDelayedBlocks(file) >= DELAY_THRESHOLD)
+        flushDelayedBlocks(file, end + n);
+
+    return 0;
+}
+
+long flushFileBlocks(DirTree file) {
+    return flushDelayedBlocks(file, blocksForSize(treeFileSize(file, NULL)));
+}
+
+long fillFileBlocks(DirTree file, long lo, long hi) {
+    long needed = 0;
+    long off, end, blk, o;
+
+    if (!file || !isTreeFile(file) || lo < 0 || hi < lo)
+        return -1;
+
+    /* Pending blocks must be placed before the map is addressed */
+    flushFileBlocks(file);
+
+    /* Count the holes and shared blocks first, so that nothing is
+       allocated on failure */
+    for (off = lo; off < hi; off = end) {
+        blk = mapMemoryOffset(file, off, &end);
+        if (end > hi)
+            end = hi;
+
+        if (blk < 0)
+            needed += end - off;
+        else {
+            for (o = off; o < end; o++)
+                needed += blockRefs(blk + o - off) > 1;
+        }
+    }
+
+    if (!enoughMemFor(needed))
+        return -1;
+
+    for (off = lo; off < hi; off = end) {
+        blk = mapMemoryOffset(file, off, &end);
+        if (end > hi)
+            end = hi;
+
+        if (blk < 0) {
+            allocFileBlocks(file, off, end - off);
+            continue;
+        }
+
+        /* Copy on write: the file gets its own copy of shared blocks */
+        for (o = off; o < end; o++) {
+            long from = blk + o - off;
+            long prev, to, e;
+
+            if (blockRefs(from) < 2)
+                continue;
+
+            prev = o > 0 ? mapMemoryOffset(file, o - 1, &e) : -1;
+            to = allocBlockNear(prev >= 0 ? prev + 1 : from);
+
+            copyBlockData(from, to);
+            relocateMemoryBlock(file, from, to);
+            dropRun(from, from + 1);
+        }
+    }
+
+    return needed;
+}
+
+/**
+ * Finds the start of a free run of at least n blocks, looking from
+ * goal onwards before wrapping around to the start of the disk.
+ *
+ * return - The first block of the run, or -1 if there is none.
+ */
+static long placeRunNear(long n, long goal) {
+    long lo, hi;
+    int pass;
+
+    if (ALLOC->pick || goal <= 0 || goal >= NUM_BLOCKS)
+        return placeRun(n);
+
+    for (pass = 0; pass < 2; pass++) {
+        for (lo = ALLOC->nextFree(pass ? 0 : goal); lo < NUM_BLOCKS; lo = ALLOC->nextFree(hi)) {
+            hi = ALLOC->nextUsed(lo);
+
+            if (hi - lo >= n)
+                return lo;
+        }
+    }
+
+    return -1;
+}
+
+long preallocFile(DirTree file, long n) {
+    long end, have, tail, lo;
+
+    if (!file || !isTreeFile(file) || n < 0)
+        return -1;
+
+    /* Pending blocks come before the preallocated ones */
+    flushFileBlocks(file);
+
+    end = blocksForSize(treeFileSize(file, NULL));
+
+    /* Blocks preallocated earlier count towards the request */
+    have = preallocRun(file, end);
+    if (have >= n)
+        return 0;
+
+    end += have;
+    n -= have;
+
+    if (!enoughMemFor(n))
+        return -1;
+
+    /* One run if there is a free stretch long enough anywhere */
+    tail = lastMemoryBlock(file);
+    lo = placeRunNear(n, tail >= 0 ? tail + 1 : spreadGoal());
+
+    if (lo < 0) {
+        allocFileBlocks(file, end, n);
+        return n;
+    }
+
+    claimRun(lo, lo + n);
+    assignMemoryRunAt(file, end, lo, n);
+
+    return n;
+}
+
+long preallocatedBlocks(DirTree file) {
+    if (!file || !isTreeFile(file))
+        return 0;
+
+    return preallocRun(file, blocksForSize(treeFileSize(file, NULL)));
+}
+
+/**
+ * Moves up to len bytes between a host file and a file's data,
+ * starting at byte offset of the file. Mapped blocks are read or
+ * written in place in the disk image, a run at a time; holes read
+ * back as zeroes.
+ *
+ * return - The number of bytes moved, or -1 if a write reaches a
+ *          hole or the host file fails.
+ */
+static long moveFileData(DirTree file, long offset, int fd, long len, int writing) {
+    static char zeroes[4096];
+    long pos = offset, stop = offset + len;
+
+    if (!IMAGE || !file || !isTreeFile(file) || offset < 0 || len < 0)
+        return -1;
+
+    while (pos < stop) {
+        long end, span, blk;
+        char *data;
+
+        blk = mapMemoryOffset(file, pos / BLOCK_SIZE, &end);
+        span = stop - pos;
+        if (end < LONG_MAX && end * BLOCK_SIZE - pos < span)
+            span = end * BLOCK_SIZE - pos;
+
+        if (blk < 0) {
+            if (writing)
+                return -1;
+            data = zeroes;
+            if (span > (long) sizeof(zeroes))
+                span = sizeof(zeroes);
+        } else
+            data = IMAGE + blk * BLOCK_SIZE + pos % BLOCK_SIZE;
+
+        /* The host file is read or written straight from the mapping */
+        span = writing ? read(fd, data, span) : write(fd, data, span);
+        if (span < 0)
+            return -1;
+        if (!span)
+            break;
+
+        pos += span;
+    }
+
+    return pos - offset;
+}
+
+long writeFileData(DirTree file, long offset, int fd, long len) {
+    return moveFileData(file, offset, fd, len, 1);
+}
+
+long readFileData(DirTree file, long offset, int fd, long len) {
+    return moveFileData(file, offset, fd, len, 0);
+}
+
+long cancelDelayedBlocks(DirTree file, long n) {
+    long delayed = getDelayedBlocks(file);
+
+    if (n > delayed)
+        n = delayed;
+
+    RESERVED_BLOCKS -= n;
+    setReserved(file, delayed - n);
+
+    return n;
+}
+
+long syncFilesystem() {
+    long n = 0;
+
+    /* Each flush takes its file off the list */
+    while (PENDING_FILES && !isEmptyLL(PENDING_FILES))
+        n += flushFileBlocks((DirTree) nodeValLL(headOfLL(PENDING_FILES)));
+
+    return n;
+}
+
+/**
+ * Moves a block's data to a free block, updating every block map
+ * that holds it. The new block takes over the old one's references.
+ */
+static void moveBlock(long from, long to) {
+    ExtNode sec;
+
+    claimRun(to, to + 1);
+    copyBlockData(from, to);
+    relocateBlockHolders(from, to);
+
+    splitShared(from);
+    splitShared(from + 1);
+
+    if ((sec = findInET(SHARED, from))) {
+        long refs = REFS(sec);
+
+        removeET(SHARED, sec);
+        insertET(SHARED, to, to + 1, (void*) refs);
+        mergeShared(to, to + 1);
+    }
+
+    releaseRun(from, from + 1);
+}
+
+/* How a defrag walk stopped */
+#define DEFRAG_DONE     0
+#define DEFRAG_PAUSED   1
+#define DEFRAG_STALE    2
+#define DEFRAG_STUCK    3
+
+/* The state of one defragDisk call, shared with its tree walk */
+struct defragwalk {
+    long budget;
+    long moves;
+    long files;
+};
+
+/* Forgets any pass under way, so that the next step starts afresh */
+static void resetDefrag() {
+    DEFRAG_FILE = NULL;
+    DEFRAG_INDEX = 0;
+    DEFRAG_OFFSET = 0;
+    DEFRAG_POS = 0;
+}
+
+/* Saves where a paused pass is to resume */
+static int pauseDefrag(DirTree file, long offset, long pos) {
+    DEFRAG_FILE = file;
+    DEFRAG_OFFSET = offset;
+    DEFRAG_POS = pos;
+    DEFRAG_STAMP = DISK_CHANGES;
+
+    return DEFRAG_PAUSED;
+}
+
+/**
+ * Places a file's blocks from the resume point on, for walkDirTree.
+ * Files before the resume point were placed by earlier calls and are
+ * only counted.
+ */
+static int defragFile(DirTree node, void *arg) {
+    struct defragwalk *walk = (struct defragwalk*) arg;
+    long index, offset, p, blk, end;
+
+    if (!isTreeFile(node))
+        return 0;
+
+    index = walk->files++;
+
+    if (index < DEFRAG_INDEX)
+        return 0;
+
+    if (index > DEFRAG_INDEX) {
+        DEFRAG_INDEX = index;
+        DEFRAG_OFFSET = 0;
+    } else if (DEFRAG_FILE && DEFRAG_FILE != node) {
+        /* The tree changed since the pass began */
+        return DEFRAG_STALE;
+    }
+
+    offset = DEFRAG_OFFSET;
+    p = DEFRAG_POS;
+
+    /* Each block is looked up afresh, as moves change the file's runs */
+    while ((blk = mapMemoryOffset(node, offset, &end)) >= 0 || end != LONG_MAX) {
+        if (blk < 0) {
+            /* Holes take no room on disk */
+            offset = end;
+            continue;
+        }
+
+        /* A block shared with an earlier file was placed with it */
+        if (blk < p) {
+            offset++;
+            continue;
+        }
+
+        if (blk != p) {
+            if (isUsed(p)) {
+                /* Evict the current occupant, preferably past every
+                   block that will be packed, which is never more than
+                   are allocated */
+                long q = ALLOC->nextFree(USED_BLOCKS);
+
+                if (q >= NUM_BLOCKS)
+                    q = ALLOC->nextFree(p + 1);
+
+                if (!getBlockHolder(p, 0, NULL) || q >= NUM_BLOCKS) {
+                    /* Unowned block, or no room to shuffle through */
+                    return DEFRAG_STUCK;
+                }
+
+                moveBlock(p, q);
+
+                /* The block is looked up again, as the occupant may
+                   have been a later block of this same file */
+                if (++walk->moves == walk->budget)
+                    return pauseDefrag(node, offset, p);
+                continue;
+            }
+
+            moveBlock(blk, p);
+            walk->moves++;
+        }
+
+        offset++;
+        p++;
+
+        if (walk->moves == walk->budget)
+            return pauseDefrag(node, offset, p);
+    }
+
+    DEFRAG_POS = p;
+
+    return 0;
+}
+
+long defragDisk(long budget, long *misplaced) {
+    struct defragwalk walk;
+    int status;
+
+    walk.budget = budget;
+    walk.moves = 0;
+
+    /* Blocks placed earlier in the pass may have moved or gone since */
+    if (DEFRAG_FILE && DEFRAG_STAMP != DISK_CHANGES)
+        resetDefrag();
+
+    if (!budget) {
+        *misplaced = USED_BLOCKS - DEFRAG_POS;
+        return 0;
+    }
+
+    do {
+        /* Files before the resume point are passed over, not placed */
+        walk.files = 0;
+        status = walkDirTree(ROOT_DIR, defragFile, &walk);
+
+        /* Start the pass again from the beginning */
+        if (status == DEFRAG_STALE)
+            resetDefrag();
+    } while (status == DEFRAG_STALE);
+
+    if (status == DEFRAG_PAUSED) {
+        /* Nothing from the resume point on has been checked yet */
+        *misplaced = USED_BLOCKS - DEFRAG_POS;
+        return walk.moves;
+    }
+
+    *misplaced = status == DEFRAG_STUCK ? -1 : 0;
+
+    /* The pass is over, so the next call starts a new one */
+    resetDefrag();
+
+    return walk.moves;
+}
+
+int cloneFile(DirTree src, DirTree dst) {
+    long num_ext;
+    Extent *ext;
+
+    if (!src || !dst || !isTreeFile(src) || !isTreeFile(dst))
+        return 1;
+
+    /* Reserved blocks are placed first so that they are shared too */
+    flushFileBlocks(src);
+
+    if (copyFileBlocks(src, dst))
+        return 1;
+
+    ext = getTreeFileExtents(dst, &num_ext);
+    shareBlocks(ext, num_ext);
+    updateFileSize(dst, treeFileSize(src, NULL));
+
+    return 0;
+}
+
+int takeSnapshot(char *name) {
+    char *root_name;
+
+    if (!name || !name[0] || strchr(name, '/'))
+        return 2;
+    if (getSnapshot(name))
+        return 1;
+
+    /* Reserved blocks have no place on disk to share yet */
+    syncFilesystem();
+
+    root_name = (char*) malloc((2 + strlen(name)) * sizeof(char));
+    sprintf(root_name, "@%s", name);
+
+    appendToLL(SNAPSHOTS, shareDirTree(ROOT_DIR, root_name));
+
+    free(root_name);
+
+    return 0;
+}
+
+/* The item holding the named snapshot, or NULL */
+static LLnode snapshotNode(char *name) {
+    LLnode node;
+
+    for (node = name ? headOfLL(SNAPSHOTS) : NULL; node; node = nextNodeLL(node)) {
+        /* Skip the '@' */
+        if (!strcmp(getTreeFilename((DirTree) nodeValLL(node)) + 1, name))
+            return node;
+    }
+
+    return NULL;
+}
+
+int dropSnapshot(char *name) {
+    LLnode node = snapshotNode(name);
+    DirTree snap = (DirTree) nodeValLL(node);
+    RunVec runs;
+    long nruns, i;
+
+    if (!snap)
+        return 1;
+    if (WORK_ROOT == snap)
+        return 2;
+
+    remNodeLL(SNAPSHOTS, node);
+
+    /* Only the maps that the snapshot held alone are disposed of */
+    initRunVec(&runs);
+    nruns = dropDirTree(snap, &runs);
+    for (i = 0; i < nruns; i++)
+        freeBlocks(&runs.items[i], 1);
+    flushRunVec(&runs);
+
+    return 0;
+}
+
+DirTree getSnapshot(char *name) {
+    return (DirTree) nodeValLL(snapshotNode(name));
+}
+
+long numSnapshots() {
+    return SNAPSHOTS ? sizeOfLL(SNAPSHOTS) : 0;
+}
+
+DirTree getSnapshotAt(long i) {
+    if (i < 0 || i >= numSnapshots())
+        return NULL;
+
+    return (DirTree) getFromLL(SNAPSHOTS, i);
+}
+
+DirTree writableTree(DirTree tree) {
+    BlockMap map = getTreeBlockMap(tree);
+    DirTree node;
+    int copied;
+
+    node = ownTreePath(ROOT_DIR, tree, &copied);
+
+    /* A file's new map holds its blocks alongside the old one */
+    if (node && map && getTreeBlockMap(node) != map) {
+        long num_ext;
+        Extent *ext = getTreeFileExtents(node, &num_ext);
+
+        shareBlocks(ext, num_ext);
+    }
+
+    /* The working directory may have been replaced by a copy */
+    if (copied && WORK_ROOT == ROOT_DIR)
+        WORK_DIR = findTreeNode(ROOT_DIR, WORK_DIR);
+
+    return node;
+}
+
+DirTree getRelRoot(char **path) {
+    if (!path)
+        return ROOT_DIR;
+    else if (!path[0])
+        return WORK_ROOT;
+    else if (path[0][0] == '@')
+        return getSnapshot(&path[0][1]);
+    else if (strcmp(path[0], ""))
+        return WORK_ROOT;
+    else
+        return ROOT_DIR;
+}
+
+int isReadOnly(char **path) {
+    return getRelRoot(path) != ROOT_DIR;
+}
+
+char** pathVecIn(DirTree root, DirTree tree) {
+    char **vec = pathVecOfTree(tree);
+    char *name = getTreeFilename(root);
+
+    if (vec) {
+        free(vec[0]);
+        vec[0] = (char*) malloc((1 + strlen(name)) * sizeof(char));
+        strcpy(vec[0], name);
+    }
+
+    return vec;
+}
+
+/**
+ * Follows a path from a node of root's tree. Parents are looked up
+ * in root's tree, which a snapshot's shared nodes need.
+ */
+static DirTree followPath(DirTree root, DirTree tree, char **path) {
+    char *step[2];
+
+    step[1] = NULL;
+
+    for (; tree && *path; path++) {
+        if (!strcmp(*path, ".."))
+            tree = isTreeFile(tree) ? NULL : getTreeParent(root, tree);
+        else {
+            step[0] = *path;
+            tree = getDirSubtree(tree, step);
+        }
+    }
+
+    return tree;
+}
+
+DirTree getRelTree(DirTree tree, char **path) {
+    if (!path)
+        return getRootNode();
+    else if (!path[0])
+        return getWorkDirNode();
+    else if (path[0][0] == '@') {
+        /* A path into a snapshot */
+        DirTree snap = getSnapshot(&path[0][1]);
+        return snap ? followPath(snap, snap, &path[1]) : NULL;
+    } else if (strcmp(path[0], ""))
+        return followPath(WORK_ROOT, tree, path);
+    else
+        return followPath(ROOT_DIR, ROOT_DIR, &path[1]);
+}
@@ -9,6 +9,53 @@
 
 #include "dirtree.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Selects the block allocator backing the filesystem. Must be
+ * called before init_filesystem.
+ *
+ * name - "extent" (the default) keeps allocated sectors in an
+ *        ordered extent tree; "bitmap" keeps one bit per block;
+ *        "buddy" places runs with a binary buddy system, which
+ *        keeps fragmentation bounded when files come and go in
+ *        power-of-two multiples of the block size.
+ *
+ * return - Nonzero if the name is unknown or the filesystem is
+ *          already initialized.
+ */
+int useAllocator(char *name);
+
+/**
+ * The name of the allocator in use.
+ */
+char* allocatorName();
+
+/**
+ * Selects arena mode, in which the trees' names and block maps come
+ * from an arena and flush_filesystem releases every tree and list in
+ * one reset instead of visiting each node. Must be called before
+ * init_filesystem.
+ *
+ * return - Nonzero if the filesystem is already initialized.
+ */
+int useArena(int on);
+
+/**
+ * Backs the blocks with a disk image on the host, which is created
+ * if needed, sized to hold every block and mapped into memory by
+ * init_filesystem. Must be called before init_filesystem. Without
+ * an image, blocks hold no data.
+ *
+ * return - Nonzero if the filesystem is already initialized.
+ */
+int useDiskImage(char *path);
+
+/* Whether the disk image was mapped */
+int hasDiskImage();
+
 /**
  * Initializes the filesystem. SHOULD ONLY BE CALLED ONCE!
  */
@@ -24,11 +71,15 @@ void flush_filesystem();
 DirTree getRootNode();
 DirTree getWorkDirNode();
 
+/* The root of the tree holding the working directory */
+DirTree getWorkRootNode();
+
 /**
  * Sets the directory tree node that is currently the working directory.
  * Commands are run based on the value of the working node.
+ * root - The root of the tree holding it: the root node or a snapshot.
  */
-void setWorkDirNode(DirTree);
+void setWorkDirNode(DirTree root, DirTree node);
 
 /**
  * Returns the size of a block, in bytes.
@@ -40,12 +91,48 @@ long numBlocks();
 long numSectors();
 
 /**
- * Frees a given block of memory.
+ * Frees a given block of memory. A block that is shared only loses
+ * a reference; it is released once the last one goes.
  *
  * n - The block to free
  */
 void freeBlock(long n);
 
+/**
+ * Frees a set of runs in one ordered pass, releasing each maximal
+ * span to the allocator at once rather than block by block. Blocks
+ * in the runs that are already free are skipped.
+ *
+ * runs - The runs to free, in ascending block order and not
+ *        overlapping.
+ * n    - The number of runs.
+ */
+void freeBlocks(Extent *runs, long n);
+
+/**
+ * Adds a reference to every allocated block in a set of runs, so
+ * that it takes one more free to release it.
+ */
+void shareBlocks(Extent *runs, long n);
+
+/**
+ * The number of references to a block: 0 if it is free, 1 if it is
+ * held once, and more if it is shared.
+ */
+long blockRefs(long blk);
+
+/* The number of blocks with more than one reference */
+long sharedBlocks();
+
+/**
+ * The end of the run of blocks from lo, stopping before hi, that all
+ * have the same number of references, found from the shared extents
+ * and the allocator's runs rather than block by block.
+ *
+ * return - The first block past the run, or lo if the range is empty.
+ */
+long refRunEnd(long lo, long hi);
+
 /**
  * Allocates a single block of memory.
  * 
@@ -53,30 +140,294 @@ void freeBlock(long n);
  */
 long allocBlock();
 
+/**
+ * Allocates n blocks in a single pass over the free space, first
+ * fit, as a list of contiguous runs in ascending block order.
+ *
+ * n    - The number of blocks to allocate.
+ * runs - An initialized list that the runs allocated are appended
+ *        to. Their offsets count from 0 across the request.
+ *
+ * return - The number of runs, or -1 (allocating nothing) if fewer
+ *          than n blocks are free.
+ */
+long allocBlocks(long n, RunVec *runs);
+
+/**
+ * Allocates like allocBlocks, but starts the search at a goal block
+ * (normally the block after a growing file's last one) so that files
+ * stay contiguous. The search continues forward from the goal and
+ * wraps around to block 0. The buddy allocator places blocks by its
+ * own policy and ignores the goal.
+ */
+long allocBlocksNear(long n, long goal, RunVec *runs);
+
+/**
+ * Allocates a single block at the goal, or the first free block
+ * after it.
+ *
+ * return - The block number allocated, or -1 if an error.
+ */
+long allocBlockNear(long goal);
+
+/**
+ * Suggests a goal block for a file that has no blocks yet: the start
+ * of the largest free run among a fixed-size sample, or its middle if
+ * another file ends right before it, so that neighbouring files have
+ * room to grow apart. Each call samples the runs after the previous
+ * call's, so the cost stays bounded however fragmented the disk is.
+ */
+long spreadGoal();
+
+/**
+ * Allocates 2^k contiguous blocks at once. The buddy allocator
+ * returns an aligned chunk; the others take the first free run
+ * that is long enough.
+ *
+ * return - The first block allocated, or -1 if no run fits.
+ */
+long allocBlockOrder(int k);
+
 /**
  * Determines whether or not there exists enough memory to
  * allocate the number of given bytes.
  *
  * n - The number of blocks requested.
  *
- * return - Whether or not n blocks can be requested.
+ * return - Whether or not n blocks can be requested. Blocks
+ *          reserved under delayed allocation count as taken.
  */
 int enoughMemFor(long n);
 
 /**
- * Get the list of allocated sectors.
+ * Get the allocated sectors as consecutive [start, end) bound pairs,
+ * stored flat in one array: bounds[2i] and bounds[2i+1] delimit the
+ * i-th sector. The array is heap memory owned by the caller.
+ *
+ * return - The number of sectors.
  */
-LList getAllocData();
+long getAllocData(long **bounds);
 
+/**
+ * Capacity queries. All of these are constant time: the allocator
+ * keeps running totals as blocks are claimed and released.
+ */
 long blocksAllocated();
+long blocksFree();
 long nextBlock();
 
+/**
+ * Finds the first allocated (or free) block at or after from,
+ * so that the disk can be walked run by run without copying.
+ *
+ * return - The block found, or numBlocks() if there is none.
+ */
+long nextUsedBlock(long from);
+long nextFreeBlock(long from);
+
+/**
+ * Recounts allocated blocks and sectors from the allocator itself
+ * and compares them against the running totals. Building with
+ * -DALLOC_DEBUG runs this check after every allocation and free.
+ *
+ * return - Nonzero (after printing an error) if they disagree.
+ */
+int checkAllocCounters();
+
+/**
+ * Turns delayed allocation on or off. With it on, growing a file
+ * only reserves capacity against the free block count; the blocks
+ * themselves are allocated in one contiguous batch when the file
+ * has threshold blocks reserved, when it is synced, or never if it
+ * is shrunk or deleted first.
+ *
+ * threshold - Reserved blocks per file that force allocation, or
+ *             0 to allocate immediately (the default).
+ */
+void useDelayedAlloc(long threshold);
+long delayedAllocThreshold();
+
+/* Blocks promised to files under delayed allocation */
+long blocksReserved();
+
+/**
+ * Gives a file n more blocks past the end of its current size,
+ * either immediately or, under delayed allocation, by reservation.
+ * Call before updating the file's size.
+ *
+ * return - Nonzero if there is not enough free space.
+ */
+int growFile(DirTree file, long n);
+
+/**
+ * Allocates the blocks reserved for a file.
+ *
+ * return - The number of blocks allocated.
+ */
+long flushFileBlocks(DirTree file);
+
+/**
+ * Prepares the logical blocks [lo, hi) of a file to be written:
+ * every hole in the range is allocated, and every shared block in
+ * it is copied to a block of the file's own (copy on write). Blocks
+ * reserved for the file are allocated first.
+ *
+ * return - The number of blocks allocated, or -1 (allocating none
+ *          for the range) if there is not enough free space.
+ */
+long fillFileBlocks(DirTree file, long lo, long hi);
+
+/**
+ * Preallocates blocks for a file to grow into by n blocks, without
+ * changing its size. The blocks are taken as one contiguous run when
+ * there is a free run long enough, and are used by later growFile
+ * calls before anything new is allocated. Blocks already
+ * preallocated count towards n. Like any blocks past the end of the
+ * file, they are released when the file shrinks.
+ *
+ * return - The number of blocks allocated, or -1 (allocating none)
+ *          if there is not enough free space.
+ */
+long preallocFile(DirTree file, long n);
+
+/* The number of blocks preallocated past the end of a file */
+long preallocatedBlocks(DirTree file);
+
+/**
+ * Allocates the blocks reserved for every file in the system. Files
+ * with reservations are kept in a list, so the cost does not depend
+ * on how many files there are.
+ *
+ * return - The number of blocks allocated.
+ */
+long syncFilesystem();
+
+/**
+ * Copies up to len bytes read from the host file descriptor fd into
+ * a file, starting at byte offset of the file. The blocks the range
+ * covers must already be allocated (see fillFileBlocks). The data
+ * goes straight into the disk image.
+ *
+ * return - The number of bytes copied, which is short if fd runs
+ *          out, or -1 if there is no disk image or the copy fails.
+ */
+long writeFileData(DirTree file, long offset, int fd, long len);
+
+/**
+ * Copies up to len bytes of a file, starting at byte offset, to the
+ * host file descriptor fd. Holes read as zeroes.
+ *
+ * return - The number of bytes copied, or -1 if there is no disk
+ *          image or the copy fails.
+ */
+long readFileData(DirTree file, long offset, int fd, long len);
+
+/**
+ * Drops up to n of a file's reserved blocks without allocating them.
+ *
+ * return - The number of reserved blocks dropped.
+ */
+long cancelDelayedBlocks(DirTree file, long n);
+
+/**
+ * Runs one bounded step of disk compaction. File blocks are moved
+ * so that every file becomes contiguous, in logical order, with the
+ * files packed back to back from block 0 in tree walk order and all
+ * free space collected into one region at the end of the disk. A
+ * block shared by several files is placed with the first of them,
+ * and moving it updates every block map that holds it, snapshots'
+ * included. Each step resumes the pass where the last one stopped,
+ * so foreground commands can run in between; if they allocated or
+ * freed any blocks, or the file the pass stopped at has gone, the
+ * pass starts over.
+ *
+ * budget    - The most blocks to move in this call, or -1 for no
+ *             limit. The call returns as soon as it is spent.
+ * misplaced - Receives how many allocated blocks lie past the point
+ *             the pass reached, which bounds how many are still out
+ *             of place (0 when the pass is complete), or -1 if
+ *             compaction cannot proceed: an allocated block belongs
+ *             to no block map, or the disk has no free block to move
+ *             through.
+ *
+ * return - The number of blocks moved.
+ */
+long defragDisk(long budget, long *misplaced);
+
+/**
+ * Makes an empty file a copy of another that shares all of its
+ * blocks, adding a reference to each, and is recorded as their
+ * holder. Costs O(extents) and no block allocation; either file
+ * copies a shared block before writing it.
+ *
+ * return - Nonzero if either node is not a file or dst has blocks.
+ */
+int cloneFile(DirTree src, DirTree dst);
+
+/**
+ * Saves a read-only copy of the file tree under a name. The copy is
+ * a new root sharing the live root's children, so it costs O(1)
+ * once reserved blocks are allocated. Changes to the live tree copy
+ * only the nodes on their path (see writableTree); a file's block
+ * map is copied the first time it changes, and the copy takes a
+ * reference to each of its blocks.
+ *
+ * return - 0 on success, 1 if the name is taken, 2 if it is invalid.
+ */
+int takeSnapshot(char *name);
+
+/**
+ * Deletes a snapshot, dropping its references to blocks.
+ *
+ * return - 0 on success, 1 if there is no such snapshot, 2 if the
+ *          working directory is inside it.
+ */
+int dropSnapshot(char *name);
+
+/**
+ * Gets the root of the snapshot with the given name (without the
+ * '@'), or NULL if there is none.
+ */
+DirTree getSnapshot(char *name);
+long numSnapshots();
+DirTree getSnapshotAt(long i);
+
+/**
+ * Makes a node of the live tree safe to change, copying the nodes on
+ * its path that are still shared with snapshots. Must be called
+ * before a node, or the list of a directory's children, is changed.
+ *
+ * return - The node to change, which replaces the given one.
+ */
+DirTree writableTree(DirTree);
+
+/**
+ * The root of the tree a tokenized path leads into, as taken by
+ * getRelTree: the root node, the working directory's root, or a
+ * snapshot (NULL if there is no such snapshot).
+ */
+DirTree getRelRoot(char**);
+
+/* Whether a tokenized path leads into a snapshot, which cannot be changed */
+int isReadOnly(char**);
+
+/**
+ * The path vector of a node of root's tree, whose first element is
+ * the name of root.
+ */
+char** pathVecIn(DirTree root, DirTree tree);
+
 /**
  * Gets a relative node in the tree structure.
- * tree - A subtree known to be a child of root.
+ * tree - A node of the working directory's tree.
  * path - A tokenized path between tree and the
- *        destination.
+ *        destination. A first element of "@name" starts
+ *        from the root of snapshot name.
  */
 DirTree getRelTree(DirTree, char**);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,145 @@
+#ifndef _SMALLVEC_H_
+#define _SMALLVEC_H_
+
+/**
+ * I pledge my honor that I have abided by the Stevens Honor System.
+ * Christopher Hittner
+ * James Romph
+ */
+
+/**
+ * A growable array for the command layer (C++ only). The first N
+ * elements live inside the object itself, so a short-lived vector on
+ * the stack touches the heap only once it outgrows them; after that
+ * the elements move to one contiguous heap buffer that doubles as
+ * needed. Elements are stored by value, never boxed. Lists of runs
+ * are shared with the C modules through runvec.h.
+ */
+
+#include <new>
+#include <utility>
+#include <stdlib.h>
+
+template <typename T, size_t N>
+class SmallVec {
+    /* The buffer grows by doubling, starting from the inline capacity */
+    static_assert(N > 0, "SmallVec needs room for at least one element inline");
+
+public:
+    SmallVec() : items(inlineItems()), len(0), cap(N) {}
+
+    SmallVec(SmallVec &&other) : items(inlineItems()), len(0), cap(N) {
+        take(other);
+    }
+
+    SmallVec& operator=(SmallVec &&other) {
+        if (this != &other) {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+
+    /* Copies would duplicate the heap buffer; move instead */
+    SmallVec(const SmallVec&) = delete;
+    SmallVec& operator=(const SmallVec&) = delete;
+
+    ~SmallVec() {
+        release();
+    }
+
+    size_t size() const { return len; }
+    bool empty() const { return !len; }
+
+    T* data() { return items; }
+    T* begin() { return items; }
+    T* end() { return items + len; }
+
+    T& operator[](size_t i) { return items[i]; }
+    T& back() { return items[len - 1]; }
+
+    void reserve(size_t n) {
+        if (n > cap)
+            grow(n);
+    }
+
+    void push_back(const T &val) {
+        if (len == cap)
+            grow(2 * cap);
+        new (&items[len++]) T(val);
+    }
+
+    void push_back(T &&val) {
+        if (len == cap)
+            grow(2 * cap);
+        new (&items[len++]) T(std::move(val));
+    }
+
+    void pop_back() {
+        items[--len].~T();
+    }
+
+    void clear() {
+        while (len)
+            pop_back();
+    }
+
+private:
+    /* runvec.h lays these out again for C, in the same order */
+    T *items;
+    size_t len;
+    size_t cap;
+
+    /* Raw, suitably aligned room for the inline elements */
+    alignas(T) unsigned char store[N * sizeof(T)];
+
+    T* inlineItems() { return reinterpret_cast<T*>(store); }
+    bool isInline() const { return items == reinterpret_cast<const T*>(store); }
+
+    void grow(size_t n) {
+        T *bigger = (T*) malloc(n * sizeof(T));
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+            new (&bigger[i]) T(std::move(items[i]));
+            items[i].~T();
+        }
+
+        if (!isInline())
+            free(items);
+
+        items = bigger;
+        cap = n;
+    }
+
+    void release() {
+        clear();
+        if (!isInline())
+            free(items);
+
+        items = inlineItems();
+        cap = N;
+    }
+
+    /* Moves other's elements here; this vector must be empty */
+    void take(SmallVec &other) {
+        size_t i;
+
+        if (other.isInline()) {
+            for (i = 0; i < other.len; i++)
+                push_back(std::move(other.items[i]));
+            other.clear();
+        } else {
+            /* The heap buffer changes hands */
+            items = other.items;
+            len = other.len;
+            cap = other.cap;
+
+            other.items = other.inlineItems();
+            other.len = 0;
+            other.cap = N;
+        }
+    }
+};
+
+#endif
@@ -1,15 +1,20 @@
 #include "dirtree.h"
 #include "cmds.h"
 #include "simsys.h"
+#include "pool.h"
+#include "runvec.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <time.h>
 #include <unistd.h>
 
 void testLinkedList() {
     int i;
+    LLnode node;
 
     int arr[] = { 0, 1, 2 };
 
@@ -24,6 +29,15 @@ void testLinkedList() {
         printf("The number %i\n", *((int*) getFromLL(testLL, i)));
     }
     printf("\n");
+
+    /* Handles: drop the middle item and put it back at the front */
+    remNodeLL(testLL, nodeOfLL(testLL, &arr[1]));
+    addAfterLL(testLL, NULL, &arr[1]);
+
+    printf("Size %i, backwards:", sizeOfLL(testLL));
+    for (node = tailOfLL(testLL); node; node = prevNodeLL(node))
+        printf(" %i", *((int*) nodeValLL(node)));
+    printf("\n\n");
 }
 
 void testTokenize() {
@@ -92,7 +106,7 @@ void testDirTree() {
     addDirToTree(root, path);
 
     printf("Retrieving file list\n");
-    LList files = getDirTreeChildren(root, 1);
+    LList files = getDirTreeChildren(root);
 
     printf("Files in root:\n");
     for (i = 0; i < 3; i++) {
@@ -196,3 +210,960 @@ void testCmds() {
     printf("\n\nBlock reservation test complete.\n\n");
 
 }
+
+void benchAllocatorWith(char *name) {
+    long sectors = 20000;
+    long *order = (long*) malloc(sectors * sizeof(long));
+    char *before = allocatorName();
+    long i;
+    clock_t start;
+    double secs;
+
+    printf("Fragmenting a %ld block disk into %ld sectors (%s allocator)...\n", 2*sectors, sectors, name);
+    useAllocator(name);
+    init_filesystem(512, 512 * 2 * sectors);
+
+    /* Fill the disk, then punch a hole after every block */
+    for (i = 0; i < 2*sectors; i++)
+        allocBlock();
+    for (i = 1; i < 2*sectors; i += 2)
+        freeBlock(i);
+
+    printf("Sectors: %ld, blocks allocated: %ld\n", numSectors(), blocksAllocated());
+
+    /* Free the remaining blocks in a random order */
+    srand(1);
+    for (i = 0; i < sectors; i++)
+        order[i] = 2*i;
+    for (i = sectors - 1; i > 0; i--) {
+        long j = rand() % (i+1);
+        long tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    start = clock();
+    for (i = 0; i < sectors; i++)
+        freeBlock(order[i]);
+    secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%ld random frees: %.3fs (%.2fus each)\n", sectors, secs, 1e6 * secs / sectors);
+
+    /* Refill the disk one block at a time */
+    start = clock();
+    for (i = 0; i < 2*sectors; i++)
+        allocBlock();
+    secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%ld allocations: %.3fs (%.2fus each)\n", 2*sectors, secs, 5e5 * secs / sectors);
+
+    free(order);
+    flush_filesystem();
+
+    /* Later benchmarks expect the allocator they were given */
+    useAllocator(before);
+}
+
+void benchAllocator() {
+    benchAllocatorWith("extent");
+    printf("\n");
+    benchAllocatorWith("bitmap");
+    printf("\n");
+    benchAllocatorWith("buddy");
+
+    printf("\n\nAllocator benchmark complete.\n\n");
+}
+
+/* Number of contiguous runs in a file's block map */
+long countFileRuns(DirTree file) {
+    long runs;
+
+    getTreeFileExtents(file, &runs);
+
+    return runs;
+}
+
+void benchInterleavedWritersWith(int goal) {
+    int writers = 4;
+    long rounds = 2000;
+    DirTree files[4];
+    long i, runs = 0;
+    int w;
+
+    init_filesystem(512, 512 * 4 * writers * rounds);
+
+    for (w = 0; w < writers; w++)
+        files[w] = makeDirTree("writer", 1);
+
+    /* Each writer appends one block per round, in turn */
+    for (i = 0; i < rounds; i++) {
+        for (w = 0; w < writers; w++) {
+            long tail = lastMemoryBlock(files[w]);
+            RunVec ext;
+            long n;
+
+            initRunVec(&ext);
+
+            if (goal)
+                n = allocBlocksNear(1, tail >= 0 ? tail + 1 : spreadGoal(), &ext);
+            else
+                n = allocBlocks(1, &ext);
+
+            if (n > 0)
+                assignMemoryRun(files[w], ext.items[0].start, ext.items[0].len);
+            flushRunVec(&ext);
+        }
+    }
+
+    for (w = 0; w < writers; w++)
+        runs += countFileRuns(files[w]);
+
+    printf("%s: %ld runs across %d files of %ld blocks, ",
+        goal ? "Goal-directed" : "First fit", runs, writers, rounds);
+
+    /* Delete every other file and see what is left behind */
+    for (w = 0; w < writers; w += 2) {
+        while (lastMemoryBlock(files[w]) >= 0)
+            freeBlock(releaseMemoryBlock(files[w]));
+    }
+
+    printf("%ld sectors after deleting half of them\n", numSectors());
+
+    for (w = 0; w < writers; w++)
+        flushDirTree(files[w]);
+    flush_filesystem();
+}
+
+void benchInterleavedWriters() {
+    printf("Interleaving single block appends to 4 files...\n");
+    benchInterleavedWritersWith(0);
+    benchInterleavedWritersWith(1);
+
+    printf("\n\nInterleaved writer benchmark complete.\n\n");
+}
+
+void benchDeleteLargeFileWith(int batched) {
+    long blocks = 100000;
+    DirTree file;
+    RunVec runs;
+    Extent *ext;
+    long n, i;
+    clock_t start;
+    double secs;
+
+    init_filesystem(512, 512 * blocks);
+    file = makeDirTree("large", 1);
+
+    initRunVec(&runs);
+    n = allocBlocks(blocks, &runs);
+    for (i = 0; i < n; i++)
+        assignMemoryRun(file, runs.items[i].start, runs.items[i].len);
+    flushRunVec(&runs);
+
+    start = clock();
+    if (batched) {
+        ext = getTreeFileExtents(file, &n);
+        freeBlocks(ext, n);
+    } else {
+        for (i = 0; i < blocks; i++)
+            freeBlock(i);
+    }
+    secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%s: %.3fs, %ld blocks left allocated\n",
+        batched ? "Batched free" : "Block by block", secs, blocksAllocated());
+
+    flushDirTree(file);
+    flush_filesystem();
+}
+
+void benchDeleteLargeFile() {
+    printf("Freeing a 100000 block file...\n");
+    benchDeleteLargeFileWith(0);
+    benchDeleteLargeFileWith(1);
+
+    printf("\n\nLarge file delete benchmark complete.\n\n");
+}
+
+/* Prints every pool's counts; each item taken used to be a malloc */
+void printPoolCounts() {
+    struct poolstats stats;
+    int i;
+
+    for (i = 0; !poolStats(i, &stats); i++)
+        printf("  %-20s %ld taken, %ld in use, %ld mallocs\n",
+            stats.name, stats.taken, stats.live, stats.mallocs);
+}
+
+void benchBuildTreeWith(int arena) {
+    long dirs = 100, files = 2000;
+    char dir[32], file[32];
+    char *path[3];
+    long d, f;
+    clock_t start;
+    double build, teardown;
+
+    useArena(arena);
+    init_filesystem(512, 512 * 1024);
+
+    path[0] = dir;
+    path[1] = file;
+    path[2] = NULL;
+
+    start = clock();
+    for (d = 0; d < dirs; d++) {
+        sprintf(dir, "dir%ld", d);
+        path[1] = NULL;
+        addDirToTree(getRootNode(), path);
+
+        path[1] = file;
+        for (f = 0; f < files; f++) {
+            sprintf(file, "file%ld", f);
+            addFileToTree(getRootNode(), path);
+        }
+    }
+    build = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%s: built %ld files in %.3fs\n", arena ? "Arena" : "Pools", dirs * files, build);
+    printPoolCounts();
+
+    start = clock();
+    flush_filesystem();
+    teardown = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("Torn down in %.3fs\n", teardown);
+    printPoolCounts();
+
+    useArena(0);
+}
+
+void benchBuildTree() {
+    printf("Building a tree of 200000 files...\n");
+    benchBuildTreeWith(0);
+    printf("\n");
+    benchBuildTreeWith(1);
+
+    printf("\n\nTree building benchmark complete.\n\n");
+}
+
+/* Runs one command line, echoing it first */
+void runCmd(char *line) {
+    char **argv = str_to_vec(line, ' ');
+
+    printf("$ %s\n", line);
+    cmd_exec(argv);
+    free_str_vec(argv);
+}
+
+/* The node at a path, resolved like a command's argument */
+DirTree nodeAt(char *path) {
+    char **vec = str_to_vec(path, '/');
+    DirTree node = getRelTree(getWorkDirNode(), vec);
+
+    free_str_vec(vec);
+
+    return node;
+}
+
+/**
+ * What checkFilesystem has seen so far: each block's references
+ * counted from the block maps, and the maps already counted, since a
+ * map shared by several trees holds its blocks only once.
+ */
+struct fscheck {
+    long *refs;
+    BlockMap *seen;
+    long num_seen;
+    long cap_seen;
+    long errors;
+};
+
+/* Counts one file's blocks and checks them against the owner map */
+int checkFileBlocks(DirTree node, void *arg) {
+    struct fscheck *check = (struct fscheck*) arg;
+    BlockMap map = getTreeBlockMap(node);
+    Extent *ext;
+    long num_ext, i, k, end = 0;
+
+    if (!map)
+        return 0;
+
+    for (i = 0; i < check->num_seen; i++) {
+        if (check->seen[i] == map)
+            return 0;
+    }
+
+    if (check->num_seen == check->cap_seen) {
+        check->cap_seen = check->cap_seen ? 2 * check->cap_seen : 16;
+        check->seen = (BlockMap*) realloc(check->seen, check->cap_seen * sizeof(BlockMap));
+    }
+    check->seen[check->num_seen++] = map;
+
+    ext = getTreeFileExtents(node, &num_ext);
+
+    for (i = 0; i < num_ext; i++) {
+        /* Runs are in logical order and never overlap */
+        if (ext[i].len <= 0 || ext[i].offset < end) {
+            printf("File %s: run %ld out of order\n", getTreeFilename(node), i);
+            check->errors++;
+        }
+        end = ext[i].offset + ext[i].len;
+
+        for (k = 0; k < ext[i].len; k++) {
+            long blk = ext[i].start + k;
+            long offset = -1, h = 0;
+            BlockMap holder;
+
+            if (blk < 0 || blk >= numBlocks() || nextUsedBlock(blk) != blk) {
+                printf("File %s: maps block %ld, which is not allocated\n", getTreeFilename(node), blk);
+                check->errors++;
+                continue;
+            }
+
+            check->refs[blk]++;
+
+            /* The owner map must list the file's map, at the same offset */
+            while ((holder = getBlockHolder(blk, h, &offset)) && holder != map)
+                h++;
+
+            if (!holder || offset != ext[i].offset + k) {
+                printf("File %s: block %ld has no owner record at offset %ld\n",
+                    getTreeFilename(node), blk, ext[i].offset + k);
+                check->errors++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Checks the filesystem's invariants: the allocator's running totals,
+ * every block's reference count against the block maps holding it,
+ * and the owner map against the live tree and every snapshot.
+ *
+ * return - The number of problems found, each of which is printed.
+ */
+long checkFilesystem() {
+    struct fscheck check;
+    long blk, i;
+
+    check.refs = (long*) calloc(numBlocks() ? numBlocks() : 1, sizeof(long));
+    check.seen = NULL;
+    check.num_seen = 0;
+    check.cap_seen = 0;
+    check.errors = checkAllocCounters() ? 1 : 0;
+
+    walkDirTree(getRootNode(), checkFileBlocks, &check);
+    for (i = 0; i < numSnapshots(); i++)
+        walkDirTree(getSnapshotAt(i), checkFileBlocks, &check);
+
+    for (blk = 0; blk < numBlocks(); blk++) {
+        long holders = 0;
+
+        while (getBlockHolder(blk, holders, NULL))
+            holders++;
+
+        if (check.refs[blk] != blockRefs(blk) || holders != check.refs[blk]) {
+            printf("Block %ld: %ld references and %ld owner records, but mapped %ld times\n",
+                blk, blockRefs(blk), holders, check.refs[blk]);
+            check.errors++;
+        }
+    }
+
+    free(check.refs);
+    free(check.seen);
+
+    return check.errors;
+}
+
+/* Prints the outcome of checkFilesystem */
+void printCheck() {
+    long errors = checkFilesystem();
+
+    if (errors)
+        printf("CHECK FAILED: %ld problems\n", errors);
+    else
+        printf("Check passed: counters, references and owners agree\n");
+}
+
+void testDefrag() {
+    long misplaced, moved, total = 0;
+    int i;
+
+    init_filesystem(512, 512 * 64);
+
+    /* Interleave three files, then punch holes by deleting one */
+    runCmd("create a b c");
+    for (i = 0; i < 4; i++) {
+        runCmd("append a 1000");
+        runCmd("append b 1000");
+        runCmd("append c 1000");
+    }
+    runCmd("delete b");
+    runCmd("prfiles");
+    printCheck();
+
+    printf("Sectors before: %ld\n", numSectors());
+
+    /* A budget of 3 blocks per step; each step resumes where it must */
+    do {
+        moved = defragDisk(3, &misplaced);
+        total += moved;
+        printf("Moved %ld blocks, up to %ld still out of place\n", moved, misplaced);
+        printCheck();
+    } while (misplaced > 0 && moved > 0);
+
+    printf("Moved %ld blocks in all; sectors after: %ld (expected 1)\n", total, numSectors());
+    printf("Runs: a %ld, c %ld (expected 1 each)\n", countFileRuns(nodeAt("a")), countFileRuns(nodeAt("c")));
+
+    /* A compacted disk needs no more moves */
+    moved = defragDisk(-1, &misplaced);
+    printf("Second pass moved %ld blocks (expected 0), %ld misplaced\n", moved, misplaced);
+
+    /* Changes between steps start the pass over, so nothing is missed */
+    runCmd("create d");
+    runCmd("append a 1000");
+    runCmd("append d 1000");
+    runCmd("append c 1000");
+    moved = defragDisk(2, &misplaced);
+    printf("Moved %ld blocks, up to %ld still out of place\n", moved, misplaced);
+    runCmd("append a 1000");
+    do {
+        moved = defragDisk(2, &misplaced);
+        printf("Moved %ld blocks, up to %ld still out of place\n", moved, misplaced);
+        printCheck();
+    } while (misplaced > 0);
+    printf("Sectors: %ld (expected 1); runs: a %ld, c %ld, d %ld (expected 1 each)\n", numSectors(),
+        countFileRuns(nodeAt("a")), countFileRuns(nodeAt("c")), countFileRuns(nodeAt("d")));
+
+    runCmd("prfiles");
+    flush_filesystem();
+
+    printf("\n\nDefrag test complete.\n\n");
+}
+
+void testPrdisk() {
+    long blk, end, freeRuns = 0, largest = 0, used = 0;
+
+    init_filesystem(512, 512 * 32);
+
+    /* Leave free runs of 1, 2 and 3 blocks between allocated ones */
+    for (blk = 0; blk < 16; blk++)
+        allocBlock();
+    freeBlock(2);
+    freeBlock(5);
+    freeBlock(6);
+    freeBlock(9);
+    freeBlock(10);
+    freeBlock(11);
+
+    runCmd("prdisk");
+
+    /* Walk the same runs through the public queries */
+    for (blk = 0; blk < numBlocks(); blk = end) {
+        if (nextUsedBlock(blk) == blk) {
+            end = nextFreeBlock(blk);
+            used += end - blk;
+        } else {
+            end = nextUsedBlock(blk);
+            freeRuns++;
+            if (end - blk > largest)
+                largest = end - blk;
+        }
+    }
+
+    printf("Expected %ld blocks in use, %ld free runs, largest %ld\n", used, freeRuns, largest);
+    printf("Allocated %ld, free %ld (expected 10 and 22)\n", blocksAllocated(), blocksFree());
+
+    if (checkAllocCounters())
+        printf("CHECK FAILED\n");
+
+    flush_filesystem();
+
+    printf("\n\nprdisk test complete.\n\n");
+}
+
+void testDelayedAlloc() {
+    long before;
+
+    useDelayedAlloc(8);
+    init_filesystem(512, 512 * 64);
+
+    runCmd("create a b");
+
+    /* Small appends only reserve capacity */
+    runCmd("append a 1000");
+    runCmd("append b 1000");
+    runCmd("append a 1000");
+    printf("Reserved %ld, allocated %ld (expected 6 and 0)\n", blocksReserved(), blocksAllocated());
+    printf("Room for %ld more blocks: %s (expected no)\n", blocksFree() - 5,
+        enoughMemFor(blocksFree() - 5) ? "yes" : "no");
+    printCheck();
+
+    /* Reaching the threshold places the file's blocks in one batch */
+    runCmd("append a 2000");
+    printf("a: %ld blocks in %ld runs, %ld delayed (expected 8, 1, 0)\n",
+        getTreeBlockCount(nodeAt("a")), countFileRuns(nodeAt("a")), getDelayedBlocks(nodeAt("a")));
+
+    /* Sync places the rest */
+    runCmd("sync");
+    printf("Reserved %ld, allocated %ld (expected 0 and 10)\n", blocksReserved(), blocksAllocated());
+    printCheck();
+
+    /* Deleting a file with reservations gives them back unallocated */
+    runCmd("append b 3000");
+    before = blocksAllocated();
+    runCmd("delete b");
+    printf("Reserved %ld, allocated %ld (expected 0 and %ld)\n", blocksReserved(), blocksAllocated(), before - 2);
+    printCheck();
+
+    runCmd("prfiles");
+    flush_filesystem();
+    useDelayedAlloc(0);
+
+    printf("\n\nDelayed allocation test complete.\n\n");
+}
+
+void testBlockOwners() {
+    DirTree a, b;
+    long blk, offset, end, errors = 0;
+
+    init_filesystem(512, 512 * 64);
+
+    runCmd("create a b");
+    runCmd("append a 2048");
+    runCmd("append b 1024");
+    runCmd("append a 1024");
+
+    a = nodeAt("a");
+    b = nodeAt("b");
+
+    /* Every block a file holds names it at the block's offset */
+    for (blk = 0; blk < numBlocks(); blk++) {
+        BlockMap map = getBlockHolder(blk, 0, &offset);
+
+        if (map == getTreeBlockMap(a)) {
+            if (getBlockOffset(a, blk) != offset || mapMemoryOffset(a, offset, &end) != blk)
+                errors++;
+        } else if (map == getTreeBlockMap(b)) {
+            if (getBlockOffset(b, blk) != offset || mapMemoryOffset(b, offset, &end) != blk)
+                errors++;
+        } else if (map || blockRefs(blk)) {
+            errors++;
+        }
+
+        /* A block has one holder unless it is shared */
+        if (getBlockHolder(blk, 1, NULL))
+            errors++;
+    }
+
+    printf("Owner lookups: %ld mismatches (expected 0)\n", errors);
+
+    /* Runs end where the holder or the offsets stop following on */
+    errors = 0;
+    for (blk = 0; blk < numBlocks(); blk = end) {
+        long runEnd = ownerRunEnd(blk, numBlocks());
+        BlockMap map = getBlockHolder(blk, 0, &offset);
+        long next;
+
+        for (end = blk + 1; end < numBlocks(); end++) {
+            long o;
+
+            if (getBlockHolder(end, 0, &o) != map || (map && o != offset + end - blk))
+                break;
+        }
+
+        if (runEnd != end)
+            errors++;
+
+        /* A bound inside the run cuts it short */
+        next = blk + (end - blk) / 2;
+        if (next > blk && ownerRunEnd(blk, next) != next)
+            errors++;
+    }
+
+    printf("Owner runs: %ld mismatches (expected 0)\n", errors);
+
+    runCmd("blkowner 0 63");
+    printCheck();
+
+    /* Deleted files hold nothing */
+    runCmd("delete a");
+    printf("Holder of block 0 after delete: %s (expected none)\n",
+        getBlockHolder(0, 0, NULL) ? "some" : "none");
+    runCmd("blkowner 0 63");
+    printCheck();
+
+    flush_filesystem();
+
+    printf("\n\nBlock owner test complete.\n\n");
+}
+
+/* Prints a file's runs with the logical offset each begins at */
+void printFileRuns(DirTree file) {
+    Extent *runs;
+    long n, i;
+
+    runs = getTreeFileExtents(file, &n);
+
+    for (i = 0; i < n; i++)
+        printf("  [%ld, %ld) -> blocks %ld-%ld\n", runs[i].offset, runs[i].offset + runs[i].len,
+            runs[i].start, runs[i].start + runs[i].len - 1);
+}
+
+void testSparseFiles() {
+    DirTree f;
+    long end, blk, n;
+
+    init_filesystem(512, 512 * 64);
+
+    runCmd("create f");
+    runCmd("append f 1024");
+
+    /* Growing with --extend leaves a hole instead of allocating */
+    runCmd("truncate --extend f 8192");
+    f = nodeAt("f");
+    printf("f: %ld bytes in %ld blocks (expected 8192 and 2)\n", treeFileSize(f, NULL), getTreeBlockCount(f));
+
+    /* Writes into the hole fill only the blocks they touch */
+    runCmd("write f 4096 600");
+    runCmd("write f 7680 512");
+    f = nodeAt("f");
+    printFileRuns(f);
+
+    blk = mapMemoryOffset(f, 3, &end);
+    printf("Offset 3: block %ld, hole ends at %ld (expected -1 and 8)\n", blk, end);
+    blk = mapMemoryOffset(f, 9, &end);
+    printf("Offset 9: block %ld, run ends at %ld (expected %ld and 10)\n", blk, end,
+        getTreeFileExtents(f, &n)[1].start + 1);
+    blk = mapMemoryOffset(f, 20, &end);
+    printf("Offset 20: block %ld, hole past the end: %s\n", blk, end == LONG_MAX ? "yes" : "no");
+    printCheck();
+
+    /* Truncating inside a run keeps the earlier offsets where they were */
+    runCmd("truncate f 4700");
+    f = nodeAt("f");
+    printFileRuns(f);
+    printf("f: %ld bytes in %ld blocks (expected 4700 and 4)\n", treeFileSize(f, NULL), getTreeBlockCount(f));
+    printCheck();
+
+    /* Truncating into a hole leaves only the runs before it */
+    runCmd("truncate f 2000");
+    f = nodeAt("f");
+    printFileRuns(f);
+    printf("Last block %ld, %ld blocks held (expected %ld and 2)\n", lastMemoryBlock(f),
+        getTreeBlockCount(f), getTreeFileExtents(f, &n)[0].start + 1);
+    printCheck();
+
+    runCmd("prfiles");
+    flush_filesystem();
+
+    printf("\n\nSparse file test complete.\n\n");
+}
+
+void testSnapshots() {
+    DirTree live, snap;
+    long before, misplaced, moved, i;
+
+    init_filesystem(512, 512 * 64);
+
+    runCmd("mkdir d");
+    runCmd("create d/a d/b");
+    runCmd("append d/a 2048");
+    runCmd("append d/b 1024");
+    before = blocksAllocated();
+
+    runCmd("snapshot s1");
+    printf("Allocated %ld after the snapshot (expected %ld)\n", blocksAllocated(), before);
+    printCheck();
+
+    /* The first change after the snapshot copies the map, not the data */
+    runCmd("append d/a 512");
+    live = nodeAt("d/a");
+    snap = nodeAt("@s1/d/a");
+    printf("Live a: %ld blocks, snapshot a: %ld blocks (expected 5 and 4)\n",
+        getTreeBlockCount(live), getTreeBlockCount(snap));
+    printf("Maps shared: %s (expected no)\n", getTreeBlockMap(live) == getTreeBlockMap(snap) ? "yes" : "no");
+    printf("Snapshot b still shared: %s (expected yes)\n",
+        getTreeBlockMap(nodeAt("d/b")) == getTreeBlockMap(nodeAt("@s1/d/b")) ? "yes" : "no");
+    printCheck();
+
+    /* Snapshots refuse every change */
+    runCmd("append @s1/d/a 512");
+    runCmd("truncate @s1/d/b 0");
+    runCmd("delete @s1/d/b");
+    runCmd("create @s1/d/c");
+
+    /* Names that paths would read as snapshots are refused */
+    runCmd("create d/@s1");
+    runCmd("mkdir @d");
+
+    /* A snapshot keeps deleted files' blocks */
+    runCmd("delete d/b");
+    printf("Allocated %ld after deleting b (expected %ld)\n", blocksAllocated(), before + 1);
+    runCmd("blkowner 0 63");
+    printCheck();
+
+    /* Inside a snapshot, .. does not lead back out */
+    runCmd("cd @s1/d");
+    runCmd("ls");
+    runCmd("cd ..");
+    runCmd("ls");
+    runCmd("cd /");
+
+    /* Defrag packs the live files, moving blocks the snapshot shares
+       and evicting those only it holds */
+    runCmd("create e f g");
+    for (i = 0; i < 3; i++) {
+        runCmd("append e 1000");
+        runCmd("append f 1000");
+        runCmd("append g 1000");
+    }
+    runCmd("delete f");
+    moved = 0;
+    do {
+        i = defragDisk(4, &misplaced);
+        moved += i;
+        printCheck();
+    } while (i > 0 && misplaced > 0);
+    printf("Moved %ld blocks, %ld misplaced; runs: a %ld, e %ld, g %ld (expected 1 each)\n", moved,
+        misplaced, countFileRuns(nodeAt("d/a")), countFileRuns(nodeAt("e")), countFileRuns(nodeAt("g")));
+    printf("Snapshot a: %ld runs, %ld blocks\n", countFileRuns(nodeAt("@s1/d/a")),
+        getTreeBlockCount(nodeAt("@s1/d/a")));
+    runCmd("blkowner 0 63");
+
+    /* Dropping the snapshot gives back what only it held */
+    runCmd("snapshot -d s1");
+    printf("Allocated %ld after the drop (expected %ld), %ld snapshots\n", blocksAllocated(),
+        getTreeBlockCount(nodeAt("d/a")) + getTreeBlockCount(nodeAt("e")) + getTreeBlockCount(nodeAt("g")),
+        numSnapshots());
+    printCheck();
+
+    flush_filesystem();
+
+    printf("\n\nSnapshot test complete.\n\n");
+}
+
+void testClone() {
+    DirTree a, b;
+    long before, first, end;
+
+    init_filesystem(512, 512 * 64);
+
+    runCmd("create a");
+    runCmd("append a 3000");
+    before = blocksAllocated();
+
+    /* A clone adds references, not blocks */
+    runCmd("clone a b");
+    a = nodeAt("a");
+    b = nodeAt("b");
+    first = mapMemoryOffset(a, 0, &end);
+    printf("Allocated %ld (expected %ld), refs of block %ld: %ld (expected 2), shared %ld\n",
+        blocksAllocated(), before, first, blockRefs(first), sharedBlocks());
+    printf("Sizes: a %ld, b %ld\n", treeFileSize(a, NULL), treeFileSize(b, NULL));
+    runCmd("blkowner 0 7");
+    printCheck();
+
+    /* Writing the clone copies only the block it touches */
+    runCmd("write b 0 100");
+    a = nodeAt("a");
+    b = nodeAt("b");
+    printf("Block 0: a %ld, b %ld (expected different); refs of a's %ld (expected 1)\n",
+        mapMemoryOffset(a, 0, &end), mapMemoryOffset(b, 0, &end), blockRefs(first));
+    printf("Block 1 still shared: %s (expected yes)\n",
+        mapMemoryOffset(a, 1, &end) == mapMemoryOffset(b, 1, &end) ? "yes" : "no");
+    printf("Allocated %ld (expected %ld)\n", blocksAllocated(), before + 1);
+    printCheck();
+
+    /* Deleting the original leaves the clone's blocks in place */
+    runCmd("delete a");
+    b = nodeAt("b");
+    printf("Allocated %ld (expected %ld), shared %ld (expected 0), b holds %ld blocks\n",
+        blocksAllocated(), getTreeBlockCount(b), sharedBlocks(), getTreeBlockCount(b));
+    runCmd("blkowner 0 7");
+    printCheck();
+
+    /* A clone's name must be free, and its source a file */
+    runCmd("clone b b");
+    runCmd("mkdir d");
+    runCmd("clone d e");
+
+    flush_filesystem();
+
+    printf("\n\nClone test complete.\n\n");
+}
+
+void testPrealloc() {
+    DirTree f;
+    long before;
+
+    init_filesystem(512, 512 * 64);
+
+    runCmd("create f g");
+    runCmd("append f 1000");
+    runCmd("append g 1000");
+
+    /* Preallocation reserves one run past the end of the file */
+    runCmd("prealloc f 4096");
+    f = nodeAt("f");
+    printf("f: %ld bytes, %ld blocks, %ld preallocated, %ld runs (expected 1000, 10, 8, 1)\n",
+        treeFileSize(f, NULL), getTreeBlockCount(f), preallocatedBlocks(f), countFileRuns(f));
+    printCheck();
+
+    /* Appends grow into the preallocated blocks without allocating */
+    before = blocksAllocated();
+    runCmd("append f 2000");
+    f = nodeAt("f");
+    printf("Allocated %ld (expected %ld), %ld preallocated (expected 4), %ld runs\n",
+        blocksAllocated(), before, preallocatedBlocks(f), countFileRuns(f));
+
+    /* Asking again only tops the run up */
+    runCmd("prealloc f 1024");
+    runCmd("prealloc f 4096");
+    f = nodeAt("f");
+    printf("%ld preallocated (expected 8)\n", preallocatedBlocks(f));
+    printCheck();
+
+    /* Trim hands back only what lies past the end */
+    runCmd("trim f");
+    f = nodeAt("f");
+    printf("f: %ld blocks, %ld preallocated (expected 6 and 0); allocated %ld (expected 8)\n",
+        getTreeBlockCount(f), preallocatedBlocks(f), blocksAllocated());
+    printCheck();
+
+    /* Truncating below the end releases preallocated blocks with the rest */
+    runCmd("prealloc f 2048");
+    runCmd("truncate f 512");
+    f = nodeAt("f");
+    printf("f: %ld blocks, %ld preallocated (expected 1 and 0); allocated %ld (expected 3)\n",
+        getTreeBlockCount(f), preallocatedBlocks(f), blocksAllocated());
+    printCheck();
+
+    runCmd("prfiles");
+    flush_filesystem();
+
+    printf("\n\nPreallocation test complete.\n\n");
+}
+
+void testDiskImage() {
+    char image[64], in[64], out[64], cmd[256];
+    char data[3000], back[6000];
+    FILE *fp;
+    long i, n, errors = 0;
+
+    sprintf(image, "/tmp/simsys-test-%ld.img", (long) getpid());
+    sprintf(in, "/tmp/simsys-test-%ld.in", (long) getpid());
+    sprintf(out, "/tmp/simsys-test-%ld.out", (long) getpid());
+    unlink(image);
+
+    /* Data that no block offset lines up with */
+    for (i = 0; i < 3000; i++)
+        data[i] = (char) (i * 7 % 251);
+    fp = fopen(in, "wb");
+    fwrite(data, 1, sizeof(data), fp);
+    fclose(fp);
+
+    useDiskImage(image);
+    init_filesystem(512, 512 * 64);
+    printf("Disk image mapped: %s\n", hasDiskImage() ? "yes" : "no");
+
+    /* A sparse file with the data in the middle, after another file */
+    runCmd("create g f");
+    runCmd("append g 1024");
+    runCmd("truncate --extend f 6000");
+    sprintf(cmd, "write --from %s f 1000", in);
+    runCmd(cmd);
+    sprintf(cmd, "read f 0 6000 %s", out);
+    runCmd(cmd);
+
+    fp = fopen(out, "rb");
+    n = fp ? (long) fread(back, 1, sizeof(back), fp) : 0;
+    if (fp)
+        fclose(fp);
+
+    /* The data comes back where it was written, with zeros around it */
+    for (i = 0; i < n; i++) {
+        if (back[i] != (i >= 1000 && i < 4000 ? data[i - 1000] : 0))
+            errors++;
+    }
+    printf("Read back %ld bytes (expected 6000), %ld differ (expected 0)\n", n, errors);
+    printCheck();
+
+    /* Moved blocks take their data with them */
+    runCmd("delete g");
+    printf("Moved %ld blocks\n", defragDisk(-1, &n));
+    sprintf(cmd, "read f 1000 3000 %s", out);
+    runCmd(cmd);
+
+    fp = fopen(out, "rb");
+    n = fp ? (long) fread(back, 1, sizeof(back), fp) : 0;
+    if (fp)
+        fclose(fp);
+    printf("Read back %ld bytes after defrag (expected 3000), same data: %s\n", n,
+        n == 3000 && !memcmp(back, data, 3000) ? "yes" : "no");
+    printCheck();
+
+    flush_filesystem();
+    useDiskImage(NULL);
+
+    unlink(image);
+    unlink(in);
+    unlink(out);
+
+    printf("\n\nDisk image test complete.\n\n");
+}
+
+struct walkorder {
+    char names[256];
+    long visited;
+    char *stop;
+};
+
+/* Records each node's name, stopping at the one named in the walk */
+int recordWalk(DirTree node, void *arg) {
+    struct walkorder *order = (struct walkorder*) arg;
+
+    order->visited++;
+    strcat(order->names, " ");
+    strcat(order->names, getTreeFilename(node));
+
+    return order->stop && !strcmp(getTreeFilename(node), order->stop) ? 7 : 0;
+}
+
+void testWalkDirTree() {
+    struct walkorder order;
+    int ret;
+
+    init_filesystem(512, 512 * 64);
+
+    /* Created out of order, so any order seen comes from the walk */
+    runCmd("mkdir b a");
+    runCmd("create c a/y a/x");
+    runCmd("mkdir b/z a/w");
+    runCmd("create b/z/v");
+
+    memset(&order, 0, sizeof(order));
+    ret = walkDirTree(getRootNode(), recordWalk, &order);
+    printf("Visited%s: %ld nodes, returned %d\n", order.names, order.visited, ret);
+    printf("Expected %s a b c w x y z v: 9 nodes, returned 0\n", getTreeFilename(getRootNode()));
+
+    /* A nonzero return ends the walk and is passed back */
+    memset(&order, 0, sizeof(order));
+    order.stop = "x";
+    ret = walkDirTree(getRootNode(), recordWalk, &order);
+    printf("Stopped at x after%s: %ld nodes, returned %d (expected 6 and 7)\n", order.names, order.visited, ret);
+
+    /* A walk can start below the root, or at a file */
+    memset(&order, 0, sizeof(order));
+    walkDirTree(nodeAt("b"), recordWalk, &order);
+    printf("From b:%s (expected b z v)\n", order.names);
+    memset(&order, 0, sizeof(order));
+    walkDirTree(nodeAt("c"), recordWalk, &order);
+    printf("From c:%s (expected c)\n", order.names);
+
+    flush_filesystem();
+
+    printf("\n\nTree walk test complete.\n\n");
+}